@@ -0,0 +1,196 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+namespace ols {
+
+    ///
+    /// Smooth background (light pollution gradient) model: second order polynomial per channel
+    /// over image coordinates normalized to [-1,1], fitted to sigma clipped medians sampled on
+    /// a coarse grid. Subtraction keeps the minimum of the model as a pedestal, so only the
+    /// gradient is removed and the background level is preserved
+    ///
+    struct BackgroundModel {
+        static constexpr int terms = 6;
+        int channels = 0;
+        int width = 0;
+        int height = 0;
+        double coef[3][terms] = {};
+        float pedestal[3] = {};
+
+        bool empty() const
+        {
+            return channels == 0;
+        }
+
+        /// gradient of row \a y, \a res receives width * channels interleaved values
+        void row(int y,float *res) const
+        {
+            double ny = norm(y,height);
+            for(int c=0;c<channels;c++) {
+                double const *k = coef[c];
+                double a = k[0] + k[2]*ny + k[5]*ny*ny - pedestal[c];
+                double b = k[1] + k[4]*ny;
+                double q = k[3];
+                for(int x=0;x<width;x++) {
+                    double nx = norm(x,width);
+                    res[x*channels + c] = a + (b + q*nx)*nx;
+                }
+            }
+        }
+
+        /// subtract the gradient from float image of model size in place
+        void subtract(cv::Mat &img) const
+        {
+            cv::parallel_for_(cv::Range(0,img.rows),[&](cv::Range const &range) {
+                std::vector<float> bg(width * channels);
+                for(int y=range.start;y<range.end;y++) {
+                    row(y,bg.data());
+                    float *p = img.ptr<float>(y);
+                    for(int i=0;i<width*channels;i++)
+                        p[i] = std::max(0.0f,p[i] - bg[i]);
+                }
+            });
+        }
+
+        ///
+        /// Fit the model to float image \a img (1 or 3 channels) using only \a area, the area is
+        /// split to \a grid x \a grid cells and every \a stride pixel of every \a stride row is sampled
+        ///
+        static BackgroundModel fit(cv::Mat const &img,cv::Rect area,int grid = 32,int stride = 4)
+        {
+            BackgroundModel m;
+            m.channels = img.channels();
+            m.width = img.cols;
+            m.height = img.rows;
+            int cell_w = std::max(stride,area.width / grid);
+            int cell_h = std::max(stride,area.height / grid);
+            int gx = area.width / cell_w;
+            int gy = area.height / cell_h;
+            if(gx * gy < terms * 2) {
+                m.channels = 0;
+                return m;
+            }
+            std::vector<cv::Point2d> pos;
+            std::vector<float> values[3];
+            std::vector<float> samples;
+            for(int cy=0;cy<gy;cy++) {
+                for(int cx=0;cx<gx;cx++) {
+                    int x0 = area.x + cx*cell_w;
+                    int y0 = area.y + cy*cell_h;
+                    pos.push_back(cv::Point2d(norm(x0 + cell_w/2,m.width),norm(y0 + cell_h/2,m.height)));
+                    for(int c=0;c<m.channels;c++) {
+                        samples.clear();
+                        for(int y=y0;y<y0+cell_h;y+=stride) {
+                            float const *p = img.ptr<float>(y) + c;
+                            for(int x=x0;x<x0+cell_w;x+=stride)
+                                samples.push_back(p[x*m.channels]);
+                        }
+                        values[c].push_back(clipped_median(samples));
+                    }
+                }
+            }
+            for(int c=0;c<m.channels;c++)
+                fit_channel(pos,values[c],m.coef[c]);
+            m.calc_pedestal();
+            return m;
+        }
+
+    private:
+        static double norm(int v,int size)
+        {
+            return size > 1 ? 2.0 * v / (size - 1) - 1.0 : 0.0;
+        }
+
+        static float median(std::vector<float> &v)
+        {
+            std::nth_element(v.begin(),v.begin() + v.size()/2,v.end());
+            return v[v.size()/2];
+        }
+
+        /// median with stars removed by iterative 3 sigma clipping
+        static float clipped_median(std::vector<float> &v)
+        {
+            if(v.empty())
+                return 0;
+            float m = median(v);
+            for(int iter=0;iter<3;iter++) {
+                std::vector<float> dev(v.size());
+                for(size_t i=0;i<v.size();i++)
+                    dev[i] = std::abs(v[i] - m);
+                float sigma = 1.4826f * median(dev);
+                if(sigma <= 0)
+                    break;
+                auto end = std::remove_if(v.begin(),v.end(),[&](float x) { return std::abs(x - m) > 3 * sigma; });
+                if(end == v.end() || end == v.begin())
+                    break;
+                v.erase(end,v.end());
+                m = median(v);
+            }
+            return m;
+        }
+
+        /// least squares fit, cells above the surface (nebulae, bright stars) are rejected iteratively
+        static void fit_channel(std::vector<cv::Point2d> const &pos,std::vector<float> const &values,double coef[terms])
+        {
+            int N = pos.size();
+            std::vector<bool> use(N,true);
+            for(int iter=0;iter<3;iter++) {
+                cv::Mat A(0,terms,CV_64F),b(0,1,CV_64F);
+                for(int i=0;i<N;i++) {
+                    if(!use[i])
+                        continue;
+                    double x = pos[i].x, y = pos[i].y;
+                    double r[terms] = { 1, x, y, x*x, x*y, y*y };
+                    A.push_back(cv::Mat(1,terms,CV_64F,r));
+                    b.push_back(double(values[i]));
+                }
+                if(A.rows < terms)
+                    break;
+                cv::Mat sol;
+                cv::solve(A,b,sol,cv::DECOMP_SVD);
+                for(int k=0;k<terms;k++)
+                    coef[k] = sol.at<double>(k);
+                std::vector<float> res(N);
+                std::vector<float> abs_res;
+                for(int i=0;i<N;i++) {
+                    res[i] = values[i] - eval(coef,pos[i].x,pos[i].y);
+                    if(use[i])
+                        abs_res.push_back(std::abs(res[i]));
+                }
+                float sigma = 1.4826f * median(abs_res);
+                if(sigma <= 0)
+                    break;
+                bool changed = false;
+                for(int i=0;i<N;i++) {
+                    bool u = res[i] < 2.5f * sigma;
+                    changed = changed || u != use[i];
+                    use[i] = u;
+                }
+                if(!changed)
+                    break;
+            }
+        }
+
+        static double eval(double const *k,double x,double y)
+        {
+            return k[0] + k[1]*x + k[2]*y + k[3]*x*x + k[4]*x*y + k[5]*y*y;
+        }
+
+        void calc_pedestal()
+        {
+            constexpr int steps = 32;
+            for(int c=0;c<channels;c++) {
+                double minv = eval(coef[c],-1,-1);
+                for(int i=0;i<=steps;i++) {
+                    for(int j=0;j<=steps;j++) {
+                        minv = std::min(minv,eval(coef[c],2.0*j/steps - 1,2.0*i/steps - 1));
+                    }
+                }
+                pedestal[c] = std::max(0.0,minv);
+            }
+        }
+    };
+}
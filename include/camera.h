@@ -151,6 +151,7 @@ namespace ols {
         int height; /// image height
         void const *data; /// data - pointer becomes invalid when callback ends, points to null terminamted char const * for \a stream_error format to indicate caputre error
         size_t data_size; /// size of data in bytes
+        int dropped_frames = 0; /// total frames lost by camera/driver since the stream started, if known
     };
 
     /// callback to pass to camera - called from separate thread when frame is ready
@@ -5,6 +5,7 @@
 #include "video_frame.h"
 #include "camera.h"
 #include "common_data.h"
+#include "background.h"
 #include <map>
 
 namespace ols {
@@ -24,11 +25,27 @@ namespace ols {
         int stacked = 0;
         int missed = 0;
         int dropped = 0;
+        int sdk_dropped = 0;
+        int gaps = 0;                       /// frames missing according to driver frame counter
+        int skipped = 0;                    /// frames skipped due to frame rate limit
+        double capture_latency_ms = -1;     /// average capture to enqueue latency, -1 unknown
+        double queue_latency_ms = -1;       /// average enqueue to stacked latency
+        double queue_latency_max_ms = -1;
+        double stacked_latency_ms = -1;     /// average capture to stacked latency, -1 unknown
         double since_saved_s = 0;
         std::vector<int> histogramm;
         virtual ~StatsData() {}
     };
 
+    /// stacked image cached for preview rendering
+    struct StackedPreviewData : public QueueData {
+        cv::Mat image;                  /// white balanced linear image, 16 bit
+        std::vector<int> histogramm;    /// luminance histogram of fully stacked area
+        bool plate_solving = false;     /// send rendered image for plate solving
+        BackgroundModel background;     /// gradient to subtract while rendering, may be empty
+        virtual ~StackedPreviewData() {}
+    };
+
     struct ErrorNotificationData : public QueueData {
         std::string source;
         std::string message;
@@ -48,6 +65,12 @@ namespace ols {
         StretchInfo stretch;
         bool live_is_stretched = false;
         int dropped = 0;
+        int sdk_dropped = 0; /// frames lost by camera since previous frame
+        int gaps = 0;        /// frame counter gaps since previous frame
+        int skipped = 0;     /// frames skipped by frame rate limit since previous frame
+        double enqueue_ts = 0;  /// unix time frame was pushed to the pipeline
+        double capture_latency = -1; /// seconds between capture and enqueue, -1 if unknown
+        bool reference = false; /// registration reference only, not stacked (offline two pass processing)
     };
 
     struct LiveControl : public QueueData {
@@ -61,6 +84,16 @@ namespace ols {
         virtual ~LiveControl() {}
     };
 
+    /// additional product stacked from the same frames and registration as the main stack
+    struct StackerOutputConfig {
+        std::string suffix;             // appended to the output name of the saved files
+        int channel = -1;               // -1 - all channels, 0,1,2 - B,G,R extracted as mono
+        bool remove_satellites = false;
+        bool frame_weighting = false;
+        int drizzle_scale = 1;
+        float drizzle_pixfrac = 0.7;
+    };
+
     struct StackerControl : public QueueData {
         enum ControlType {
             ctl_init,     /// start stacking
@@ -75,6 +108,7 @@ namespace ols {
         std::string output_path; /// identification of stacking
         std::string name;
         bool save_inputs = false;
+        std::string save_format = "files"; /// "files" - frame per file, "ser" - single SER container
         std::string format;
         int bin=1;
         int width = 0;
@@ -83,6 +117,18 @@ namespace ols {
         bool calibration = false;  /// Collect calibration data
         bool remove_satellites = false; // apply sat removal algorithm
         bool rollback_on_pause = false; // remove last frame on pause
+        int rollback_frames = 1;        // number of last frames removed on pause
+        int drizzle_scale = 1;          // drizzle output scale, 1 - disabled
+        float drizzle_pixfrac = 0.7;    // drizzle drop size relative to input pixel
+        int lucky_window = 0;           // lucky imaging selection window in frames, 0 - disabled
+        float lucky_keep_percent = 10;  // percent of sharpest frames stacked from each window
+        bool lucky_compact = false;     // keep frames waiting for selection as 16 bit
+        bool canvas = false;            // expanding mosaic canvas following the drift
+        bool frame_weighting = false;   // weight frames by SNR
+        bool background_extraction = false; // subtract light pollution gradient before stretch
+        bool wb_stars = false;          // white balance by star colors instead of background
+        bool estimate_rotation = false; // image based derotation by log-polar phase correlation
+        std::vector<StackerOutputConfig> outputs; // additional products sharing registration
 
         bool derotate = false; /// enable auto derote for AZ mount
         bool derotate_mirror = false; /// inverse direction for mirror image
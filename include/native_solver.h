@@ -0,0 +1,68 @@
+#pragma once
+#include "plate_solver.h"
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+namespace ols {
+
+    ///
+    /// Star database in ASTAP format: .1476 (D series) and .290 (G series) area files as
+    /// downloaded by AstapDBDownloadApp. Each file covers an area of the sky with stars
+    /// sorted by magnitude, so the brightest stars are read first
+    ///
+    class AstapStarDB {
+    public:
+        struct Star {
+            double ra;      /// degrees
+            double de;      /// degrees
+            float mag;
+        };
+
+        AstapStarDB(std::string const &dir);
+
+        /// true if no supported area files were found
+        bool empty();
+
+        ///
+        /// Up to \a limit brightest stars within \a radius degrees from \a ra, \a de, sorted by magnitude
+        ///
+        std::vector<Star> stars(double ra,double de,double radius,int limit);
+    private:
+        struct Area {
+            std::string path;
+            cv::Vec3d center;
+            double radius;  /// radians
+        };
+
+        void build_index();
+        /// call \a on_star for each star of the file until it returns false
+        template<typename F>
+        void read_area(std::string const &path,F on_star);
+
+        std::string dir_;
+        bool indexed_ = false;
+        std::vector<Area> areas_;
+    };
+
+    ///
+    /// In process plate solver: stars extracted from the image are grouped to quads of nearest
+    /// neighbours and matched by ratios of the quad distances against the database stars searched
+    /// on a spiral around the hint, the affine fit of matched stars gives the WCS
+    ///
+    class NativePlateSolver {
+    public:
+        NativePlateSolver(std::string const &db_dir);
+
+        /// star database is present
+        bool available();
+
+        ///
+        /// Solve \a img, \a fov_deg is the height of the field, the search covers \a radius_deg
+        /// around \a ra_deg, \a de_deg, throws std::runtime_error if no solution was found
+        ///
+        PlateSolver::WCS solve(cv::Mat const &img,double fov_deg,double ra_deg,double de_deg,double radius_deg,double timeout);
+    private:
+        AstapStarDB db_;
+    };
+}
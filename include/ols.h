@@ -15,6 +15,7 @@
 namespace ols {
 
     class StackerStatsNotification;
+    class PreviewTiles;
 
     class OpenLiveStacker : public CameraInterface {
     public:
@@ -72,6 +73,7 @@ namespace ols {
         queue_pointer_type debug_save_queue_         = std::shared_ptr<queue_type>(new queue_type());
         queue_pointer_type stacker_stats_queue_      = std::shared_ptr<queue_type>(new queue_type());
         queue_pointer_type plate_solving_queue_      = std::shared_ptr<queue_type>(new queue_type());
+        queue_pointer_type preview_queue_            = std::shared_ptr<queue_type>(new queue_type());
         
         std::recursive_mutex camera_lock_;
         std::unique_ptr<Camera> camera_;
@@ -81,6 +83,12 @@ namespace ols {
 
         int dropped_ = 0;
         int dropped_since_last_update_ = 0;
+        int sdk_dropped_total_ = 0;
+        int sdk_dropped_since_last_update_ = 0;
+        int last_frame_counter_ = -1;
+        int gaps_since_last_update_ = 0;
+        int skipped_since_last_update_ = 0;
+        static constexpr double max_capture_latency = 60.0;
         booster::ptime last_frame_ts_;
         double max_framerate_ = 0;
         static std::atomic<int> received_;
@@ -91,11 +99,13 @@ namespace ols {
         booster::intrusive_ptr<VideoGeneratorApp> video_generator_app_;
         booster::intrusive_ptr<VideoGeneratorApp> stacked_video_generator_app_;
         booster::intrusive_ptr<StackerStatsNotification> stats_stream_app_;
+        std::shared_ptr<PreviewTiles> preview_tiles_;
         
         std::thread video_generator_thread_;
         std::thread debug_save_thread_;
         std::thread preprocessor_thread_;
         std::thread stacker_thread_;
+        std::thread preview_thread_;
         
         std::shared_ptr<cppcms::service> web_service_;
 
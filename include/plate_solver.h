@@ -4,11 +4,21 @@
 #include <vector>
 #include <mutex>
 #include <memory>
+#include <chrono>
+#include <opencv2/core.hpp>
 
-namespace cv { class Mat; }
 namespace ols {
+    class NativePlateSolver;
+    class ProcessRunner;
     class PlateSolver {
     public:
+        /// linear WCS solution in FITS convention: 1 based pixel coordinates, y axis up, degrees
+        struct WCS {
+            double crpix1,crpix2;
+            double crval1,crval2;
+            double cd1_1,cd1_2,cd2_1,cd2_2;
+        };
+
         struct Result {
             double center_ra_deg;
             double center_de_deg;
@@ -21,26 +31,40 @@ namespace ols {
 
         static std::string db_path();
         static void init(std::string const &db_path,std::string const &path_to_astap_cli,std::string const &temp_dir=std::string());
-        static void set_image(cv::Mat img,bool stretch);
+        ///
+        /// Set latest image for plate solving. The image is referenced, not copied, so its data must
+        /// not be modified afterwards; \a owner keeps the data alive if \a img does not own it,
+        /// \a bayer marks raw single channel Bayer data
+        ///
+        static void set_image(cv::Mat const &img,bool stretch,bool bayer = false,std::shared_ptr<void const> owner = nullptr);
         static Result solve_last_image( std::string const &jpeg_with_marks,
                                         double fov_deg,
                                         double target_ra_deg,
                                         double target_de_deg,
                                         double search_radius_deg,
-                                        double timeout);
+                                        double timeout,
+                                        bool refine = false);
 
 
         PlateSolver(std::string const &db_path,std::string const &path_to_astap_cli);
+        ~PlateSolver();
 
         void set_tempdir(std::string const &p);
         
+        ///
+        /// Solve the image binned to solve_height luminance, the marks are drawn on the binned image.
+        /// If \a refine is set and the field overlaps the previously solved image, the pointing is
+        /// predicted from their phase correlation shift and verified by a small radius search first
+        ///
         Result solve_and_mark(  cv::Mat &img,bool do_stretch,
                                 std::string const &jpeg_with_marks,
                                 double fov_deg,
                                 double target_ra_deg,
                                 double target_de_deg,
                                 double search_radius_deg,
-                                double timeout);
+                                double timeout,
+                                bool bayer = false,
+                                bool refine = false);
             
 
         Result solve(   std::string const &img_path,
@@ -49,19 +73,37 @@ namespace ols {
                         double target_de_deg,
                         double search_radius_deg,
                         double timeout);
+        /// images are binned to at most this height, enough for ASTAP databases and much faster to save and solve
+        static constexpr int solve_height = 1500;
+        /// time limit of the refine search before falling back to full search
+        static constexpr double refine_timeout = 10.0;
+        /// part of the time limit given to the native solver, the rest is kept for the ASTAP fallback
+        static constexpr double native_timeout_share = 0.5;
     private:
+        static double elapsed(std::chrono::steady_clock::time_point start);
+        WCS solve_wcs(cv::Mat const &img,double fov_deg,double ra,double de,double radius,double timeout);
+        WCS solve_wcs(std::string const &img_path,double fov_deg,double ra,double de,double radius,double timeout);
+        WCS read_wcs(std::string const &path);
+        bool predict_center(cv::Mat const &img,double &ra,double &de);
+        cv::Mat prepare_image(cv::Mat const &img,bool bayer);
+        std::string staging_dir();
         std::string trim(std::string const &s);
-        Result make_result(std::string const &path,double ra,double de);
+        Result make_result(WCS const &wcs,double ra,double de);
         double get(std::map<std::string,double> const &vals,std::string const &name);
         std::map<std::string,double> parse_ini(std::string const &path,std::string &error);
-        int run(std::vector<std::string> &opts,std::string ini_path,double timeout);
+        WCS run_astap(ProcessRunner &job,std::string const &img_path,double fov_deg,double ra,double de,double radius,double timeout);
         std::string db_,exe_;
         std::string temp_dir_;
+        std::unique_ptr<NativePlateSolver> native_;
+        cv::Mat last_image_;    /// binned luminance of the last solved image, CV_32F
+        WCS last_wcs_;
 
         static std::mutex lock_;
         static std::mutex img_lock_;
         static std::unique_ptr<PlateSolver> instance_;
         static std::unique_ptr<cv::Mat> image_;
+        static std::shared_ptr<void const> image_owner_;
+        static bool bayer_;
         static bool do_stretch_;
     };
 
@@ -0,0 +1,46 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <tuple>
+
+namespace ols {
+
+    ///
+    /// Deep Zoom style image pyramid of the latest stacked preview. Level max_level is the full
+    /// resolution image, each lower level is half the size of the next one down to 1x1 at level 0.
+    /// Levels and JPEG tiles are generated on first request and cached until the next update
+    ///
+    class PreviewTiles {
+    public:
+        static constexpr int tile_size = 256;
+
+        struct Info {
+            int width = 0;
+            int height = 0;
+            int max_level = 0;
+            int version = 0;    /// incremented on each update
+        };
+
+        /// new rendered 8 bit image, the image must not be modified afterwards
+        void update(cv::Mat img8);
+        /// drop the image, for example when stacking is restarted
+        void clear();
+
+        Info info();
+
+        /// JPEG data of the tile, null if there is no image or no such tile
+        std::shared_ptr<std::vector<unsigned char> > tile(int level,int col,int row);
+    private:
+        cv::Mat level_image(int level);
+
+        typedef std::tuple<int,int,int> tile_id;
+
+        std::mutex lock_;
+        Info info_;
+        std::vector<cv::Mat> levels_;
+        std::map<tile_id,std::shared_ptr<std::vector<unsigned char> > > cache_;
+    };
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "preview_tiles.h"
+
+#include <cppcms/application.h>
+#include <cppcms/http_context.h>
+#include <cppcms/http_response.h>
+#include <cppcms/url_dispatcher.h>
+#include <cppcms/json.h>
+#include <booster/log.h>
+
+namespace ols {
+    ///
+    /// Tiled access to the stacked preview
+    ///
+    ///   GET /info                     - pyramid description
+    ///   GET /{level}/{col}_{row}.jpeg - tile
+    ///
+    class PreviewTilesApp : public cppcms::application {
+    public:
+        PreviewTilesApp(cppcms::service &srv,std::shared_ptr<PreviewTiles> tiles) :
+            cppcms::application(srv),
+            tiles_(tiles)
+        {
+            dispatcher().map("GET","/info/?",&PreviewTilesApp::info,this);
+            dispatcher().map("GET","/(\\d+)/(\\d+)_(\\d+)\\.jpe?g",&PreviewTilesApp::tile,this,1,2,3);
+        }
+        void info()
+        {
+            auto inf = tiles_->info();
+            cppcms::json::value r;
+            r["width"] = inf.width;
+            r["height"] = inf.height;
+            r["tile_size"] = int(PreviewTiles::tile_size);
+            r["overlap"] = 0;
+            r["max_level"] = inf.max_level;
+            r["version"] = inf.version;
+            r["format"] = "jpeg";
+            response().set_content_header("application/json");
+            response().cache_control("no-cache");
+            response().out() << r;
+        }
+        void tile(std::string level,std::string col,std::string row)
+        {
+            auto data = tiles_->tile(atoi(level.c_str()),atoi(col.c_str()),atoi(row.c_str()));
+            if(!data) {
+                response().status(404);
+                return;
+            }
+            response().content_type("image/jpeg");
+            response().cache_control("no-cache");
+            response().out().write(reinterpret_cast<char const *>(data->data()),data->size());
+        }
+    private:
+        std::shared_ptr<PreviewTiles> tiles_;
+    };
+}
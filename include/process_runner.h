@@ -0,0 +1,43 @@
+#pragma once
+#include <string>
+#include <vector>
+
+namespace ols {
+
+    ///
+    /// Runs an external tool as a job with its own temporary directory, waits for completion with
+    /// pidfd and poll (no sleeping loop) and captures its stdout and stderr. The directory and
+    /// its files are removed when the runner is destroyed
+    ///
+    class ProcessRunner {
+    public:
+        struct Result {
+            int exit_code = -1;     /// exit status, -1 if killed by a signal
+            bool timed_out = false; /// killed after the timeout
+            std::string out;        /// stdout, last max_output bytes
+            std::string err;        /// stderr, last max_output bytes
+        };
+
+        static constexpr size_t max_output = 65536;
+
+        /// create unique job directory under \a temp_root
+        ProcessRunner(std::string const &temp_root,std::string const &job_name = "ols_job");
+        ~ProcessRunner();
+        ProcessRunner(ProcessRunner const &) = delete;
+        ProcessRunner &operator=(ProcessRunner const &) = delete;
+
+        /// job directory, also the working directory of the process
+        std::string const &work_dir() const
+        {
+            return dir_;
+        }
+
+        ///
+        /// Run \a args, args[0] is the executable, searched in PATH unless it is a path. The process is
+        /// killed after \a timeout seconds. Throws std::system_error if it can't be started
+        ///
+        Result run(std::vector<std::string> const &args,double timeout);
+    private:
+        std::string dir_;
+    };
+}
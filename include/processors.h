@@ -2,6 +2,7 @@
 #include "data_items.h"
 #include <thread>
 namespace ols {
+    class PreviewTiles;
     std::thread start_preprocessor(queue_pointer_type in,
                                    queue_pointer_type out,
                                    queue_pointer_type error_queue);
@@ -9,6 +10,13 @@ namespace ols {
                               queue_pointer_type out,
                               queue_pointer_type stats_and_error,
                               queue_pointer_type plate_solving_output,
-                              std::string data_dir);
+                              std::string data_dir,
+                              queue_pointer_type preview = queue_pointer_type());
+    /// renders stacked preview from StackedPreviewData, handles stretch updates without the stacker
+    std::thread start_preview_renderer(queue_pointer_type in,
+                                       queue_pointer_type out,
+                                       queue_pointer_type plate_solving_output,
+                                       std::string data_dir,
+                                       std::shared_ptr<PreviewTiles> tiles = nullptr);
     std::thread start_debug_saver(queue_pointer_type in,queue_pointer_type error_queue,std::string debug_dir);
 }
@@ -0,0 +1,168 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "camera.h"
+
+namespace ols {
+
+    ///
+    /// SER video container header, see SER format description v3
+    ///
+#pragma pack(push,1)
+    struct SERHeader {
+        char file_id[14];       /// "LUCAM-RECORDER"
+        int32_t lu_id;
+        int32_t color_id;       /// see SERColorId
+        int32_t little_endian;  /// see comment in SERWriter
+        int32_t width;
+        int32_t height;
+        int32_t pixel_depth;    /// bits per plane
+        int32_t frame_count;
+        char observer[40];
+        char instrument[40];
+        char telescope[40];
+        int64_t date_time;      /// local time, 100ns ticks since 0001-01-01
+        int64_t date_time_utc;  /// UTC time, 100ns ticks since 0001-01-01
+    };
+#pragma pack(pop)
+
+    static_assert(sizeof(SERHeader) == 178,"SER header must be 178 bytes");
+
+    enum SERColorId {
+        ser_mono = 0,
+        ser_bayer_rggb = 8,
+        ser_bayer_grbg = 9,
+        ser_bayer_gbrg = 10,
+        ser_bayer_bggr = 11,
+        ser_rgb = 100,
+        ser_bgr = 101
+    };
+
+    int64_t ser_timestamp_from_unix(double unix_ts);
+    double  ser_timestamp_to_unix(int64_t ser_ts);
+
+    ///
+    /// Append only SER writer, keeps single file open and writes data in large chunks aligned
+    /// to file offsets, file space is preallocated ahead and fdatasync is called once per
+    /// sync interval rather than per frame. Timestamps are written as trailer on close.
+    ///
+    /// Frame count in the header is updated on each sync so the file is readable even if
+    /// the writer wasn't closed properly (the timestamps trailer is missing in such a case)
+    ///
+    class SERWriter {
+    public:
+        SERWriter(std::string const &path,int width,int height,int channels,int bytes_per_channel,CamBayerType bayer = bayer_na);
+        ~SERWriter();
+
+        SERWriter(SERWriter const &) = delete;
+        void operator=(SERWriter const &) = delete;
+
+        /// frame must match width/height/type given in constructor
+        void write(cv::Mat const &frame,double unix_timestamp);
+        /// flush full chunks, update frame count and fdatasync
+        void sync();
+        /// flush everything, write timestamps trailer and close the file
+        void close();
+
+        /// sync every N frames, 0 - only on close
+        void set_sync_interval(int frames)
+        {
+            sync_interval_ = frames;
+        }
+        int frames() const
+        {
+            return timestamps_.size();
+        }
+    private:
+        void append(void const *data,size_t size);
+        void flush_buffer();
+        void preallocate(size_t upto);
+        void update_header(int frames);
+        int frames_on_disk();
+
+        static constexpr size_t chunk_size = 4 << 20;
+        static constexpr size_t prealloc_step = 256 << 20;
+
+        std::string path_;
+        int fd_ = -1;
+        SERHeader header_;
+        size_t frame_size_;
+        int width_,height_,cv_type_;
+        char *buffer_ = nullptr;
+        size_t buffer_pos_ = 0;
+        size_t file_pos_ = 0;
+        size_t allocated_ = 0;
+        bool can_preallocate_ = true;
+        int sync_interval_ = 100;
+        int since_sync_ = 0;
+        std::vector<int64_t> timestamps_;
+    };
+
+    ///
+    /// Read only SER reader, the file is memory mapped and frames are returned as cv::Mat
+    /// referencing the mapping directly (no copy) so they remain valid only as long
+    /// as the reader exists.
+    ///
+    /// Frame count is derived from the file size if header count is missing (file that wasn't
+    /// closed properly)
+    ///
+    class SERReader {
+    public:
+        SERReader(std::string const &path);
+        ~SERReader();
+
+        SERReader(SERReader const &) = delete;
+        void operator=(SERReader const &) = delete;
+
+        int frames() const
+        {
+            return frames_;
+        }
+        int width() const
+        {
+            return header_.width;
+        }
+        int height() const
+        {
+            return header_.height;
+        }
+        int channels() const
+        {
+            return CV_MAT_CN(cv_type_);
+        }
+        int bytes_per_channel() const
+        {
+            return CV_ELEM_SIZE1(cv_type_);
+        }
+        CamBayerType bayer() const
+        {
+            return bayer_;
+        }
+        /// stream type matching the frame layout as delivered by a camera
+        CamStreamType stream_type() const;
+
+        bool has_timestamps() const
+        {
+            return timestamps_ != nullptr;
+        }
+        /// unix timestamp of the frame, requires has_timestamps()
+        double timestamp(int index) const;
+
+        /// frame referencing mapped memory, RGB ordered files are converted to BGR and copied
+        cv::Mat frame(int index) const;
+        /// hint the kernel to read frames [index,index+count) ahead
+        void prefetch(int index,int count) const;
+    private:
+        std::string path_;
+        SERHeader header_;
+        void *map_ = nullptr;
+        size_t map_size_ = 0;
+        size_t frame_size_ = 0;
+        int frames_ = 0;
+        int cv_type_ = 0;
+        CamBayerType bayer_ = bayer_na;
+        int64_t const *timestamps_ = nullptr;
+    };
+}
@@ -6,6 +6,11 @@
 #include "common_data.h"
 
 #include "simd_utils.h"
+#include "tiled_canvas.h"
+#include "background.h"
+#include <memory>
+#include <algorithm>
+#include <deque>
 
 //#define DEBUG
 #ifdef DEBUG
@@ -15,15 +20,97 @@
 
 namespace ols {
 
+    ///
+    /// Stretch settings, shared by the stacker and the preview renderer
+    ///
+    struct StretchSettings {
+        bool auto_stretch = true;
+        float low_cut = 0.0f;
+        float high_cut = 1.0f;
+        float target_gamma = 2.2f;
+        float high_per = 99.99f;
+        double gamma_limit = 4.0;
+        double mean_target = 0.25;
+
+        void set(bool auto_stretch_v,float low_index,float high_index,float stretch_index)
+        {
+            auto_stretch = auto_stretch_v;
+            high_cut = std::max(1.0f,std::min(32.0f,high_index));
+            low_cut  = std::min(high_cut - 0.001f,std::max(0.0f,low_index));
+            target_gamma = std::max(1.0f,std::min(8.0f,stretch_index));
+        }
+    };
+
+    ///
+    /// Calculate stretch from luminance histogram of linear [0,1] image, the stretched
+    /// value is ((v * gain - cut) clipped to [0,1]) ^ (1/gamma)
+    ///
+    inline StretchInfo calc_stretch(int const *counters,int hist_bins,StretchSettings const &s)
+    {
+        StretchInfo res;
+        res.auto_stretch = s.auto_stretch;
+        if(!s.auto_stretch) {
+            res.gamma = s.target_gamma;
+            res.gain = s.high_cut;
+            res.cut = s.low_cut;
+            return res;
+        }
+        int N = 0;
+        for(int i=0;i<hist_bins;i++)
+            N += counters[i];
+        int sum=N;
+        int hp=-1;
+        for(int i=hist_bins-1;i>=0;i--) {
+            sum-=counters[i];
+            if(sum*100.0f/N <= s.high_per) {
+                hp = i;
+                break;
+            }
+        }
+        int end = hp / 2;
+        int max_diff = 0;
+        for(int i=0;i<end-1;i++) {
+            int diff = counters[i+1] - counters[i];
+            max_diff = std::max(diff,max_diff);
+        }
+        int lp = 0;
+        for(int i=0;i<end-1;i++) {
+            lp = i;
+            int diff = counters[i+1] - counters[i];
+            if(diff * 10 >= max_diff)
+                break;
+        }
+        double scale = (hist_bins-1.0)/hp;
+        double offset = -lp/(hist_bins - 1.0);
+        
+        double mean = 0;
+        int total = 0;
+        for(int i=0;i<lp;i++) {
+            total += counters[i];
+        }
+        for(int i=lp;i<=hp;i++) {
+            mean += (i - lp) / (hist_bins - 1.0) * counters[i] * scale;
+            total += counters[i];
+        }
+        for(int i=hp+1;i<hist_bins;i++) {
+            mean += counters[i] * scale;
+            total += counters[i];
+        }
+        mean = mean / total;
+        BOOSTER_INFO("stacker") << "Scale " << scale << " offset=" << (-offset) << " relative cut =" << (-offset*scale) ;
+        res.gamma = std::max(1.0,std::min(s.gamma_limit,log(mean)/log(s.mean_target)));
+        res.gain = scale;
+        res.cut = -offset * scale;
+        BOOSTER_INFO("stacker") << "Stretch mean " << mean << "-> gamma=" << res.gamma;
+        return res;
+    }
+
     struct Stacker {
     public:
 
         bool enable_subpixel_registration = false;
         int  subpixel_factor_ = 1;
 
-        float high_per_=99.99f;
-        double gamma_limit_ = 4.0;
-        double mean_target_ = 0.25;
         static constexpr int hist_bins=1024;
         int counters_[hist_bins];
         
@@ -84,9 +171,181 @@ namespace ols {
             make_fft_blur();
         }
 
-        void set_rollback_on_pause(bool v)
+        ///
+        /// Remove last \a frames stacked frames on pause. Instead of copying the accumulator on every
+        /// frame the contribution of the last frames is kept with a record of the changes they made to
+        /// the satellite max. The newest frame is kept as float, so rolling back one frame is exact,
+        /// older ones as 16 bit scaled to their own range: each extra frame costs 2 bytes per sample
+        ///
+        void set_rollback_on_pause(bool v,int frames = 1)
         {
             rollback_on_pause_ = v;
+            rollback_frames_ = v ? std::max(1,frames) : 0;
+            undo_.clear();
+        }
+
+        ///
+        /// Drizzle integration: each input pixel is shrunk to a drop of \a pixfrac of its size and
+        /// accumulated onto output grid \a scale times finer with its area overlap as weight.
+        /// Must be called before stacking starts, replaces subpixel upscaling and satellite removal
+        ///
+        void set_drizzle(int scale,float pixfrac)
+        {
+            if(canvas_) {
+                BOOSTER_WARNING("stacker") << "Drizzle is not supported in canvas mode, ignoring";
+                scale = 1;
+            }
+            if(scale <= 1) {
+                drizzle_scale_ = 1;
+                return;
+            }
+            drizzle_scale_ = std::min(4,scale);
+            drizzle_pixfrac_ = std::max(0.1f,std::min(1.0f,pixfrac));
+            if(remove_satellites_) {
+                BOOSTER_WARNING("stacker") << "Satellite removal is not supported with drizzle, disabling";
+                remove_satellites_ = false;
+                frame_max_.release();
+            }
+            int width = sum_.cols / subpixel_factor_;
+            int height = sum_.rows / subpixel_factor_;
+            subpixel_factor_ = 1;
+            enable_subpixel_registration = true;
+            sum_ = cv::Mat(height*drizzle_scale_,width*drizzle_scale_,cv_type_);
+            sum_.setTo(0);
+            weight_ = cv::Mat(sum_.rows,sum_.cols,CV_32FC1);
+            weight_.setTo(0);
+        }
+
+        ///
+        /// Canvas mode: the accumulator grows with the drift of the target instead of being limited
+        /// to the sensor, sum and coverage are kept in sparse tiles and the result is normalized
+        /// per pixel by coverage. Must be called before stacking starts, replaces drizzle, satellite
+        /// removal and rollback on pause
+        ///
+        void set_canvas(bool v)
+        {
+            if(!v)
+                return;
+            frame_size_ = cv::Size(sum_.cols / subpixel_factor_ / drizzle_scale_,sum_.rows / subpixel_factor_ / drizzle_scale_);
+            if(drizzle_scale_ > 1) {
+                BOOSTER_WARNING("stacker") << "Drizzle is not supported in canvas mode, disabling";
+                drizzle_scale_ = 1;
+                weight_.release();
+            }
+            if(remove_satellites_) {
+                BOOSTER_WARNING("stacker") << "Satellite removal is not supported in canvas mode, disabling";
+                remove_satellites_ = false;
+                frame_max_.release();
+            }
+            if(rollback_on_pause_) {
+                BOOSTER_WARNING("stacker") << "Rollback on pause is not supported in canvas mode, disabling";
+                rollback_on_pause_ = false;
+                rollback_frames_ = 0;
+            }
+            subpixel_factor_ = 1;
+            sum_.release();
+            undo_.clear();
+            canvas_.reset(new TiledCanvas(channels_));
+        }
+
+        ///
+        /// Weighted stacking: each frame contributes with weight derived from its SNR on the
+        /// registration ROI relatively to the first frame, the result is normalized by the weight map.
+        /// Must be called before stacking starts, replaces satellite removal
+        ///
+        void set_frame_weighting(bool v)
+        {
+            if(!v)
+                return;
+            frame_weighting_ = true;
+            if(remove_satellites_) {
+                BOOSTER_WARNING("stacker") << "Satellite removal is not supported with frame weighting, disabling";
+                remove_satellites_ = false;
+                frame_max_.release();
+            }
+            if(!canvas_ && weight_.empty()) {
+                weight_ = cv::Mat(sum_.rows,sum_.cols,CV_32FC1);
+                weight_.setTo(0);
+            }
+        }
+
+        ///
+        /// Remove light pollution gradient before stretching, the model is fitted on each
+        /// image generation and used for histogram, stretch and preview rendering
+        ///
+        void set_background_extraction(bool v)
+        {
+            background_extraction_ = v;
+        }
+
+        /// gradient model of the last generated image, empty if disabled
+        BackgroundModel const &background_model()
+        {
+            return background_;
+        }
+
+        /// calibrate white balance by star colors rather than by background
+        void set_wb_stars(bool v)
+        {
+            wb_stars_ = v;
+        }
+
+        ///
+        /// Image based derotation: rotation and scale relatively to the reference frame are estimated
+        /// by phase correlation of log-polar magnitude spectra of the registration ROI (Fourier-Mellin)
+        /// and the frame is derotated around the ROI center before translation registration.
+        /// Works without site and target coordinates, lucky imaging windows are not derotated
+        ///
+        void set_estimate_rotation(bool v)
+        {
+            estimate_rotation_ = v && window_size_ > 0;
+        }
+
+        ///
+        /// Use \a frame as registration reference instead of the first stacked frame, the frame itself
+        /// is not stacked. Must be called before stacking starts, ignored in lucky imaging mode
+        ///
+        void set_reference(cv::Mat frame)
+        {
+            if(window_size_ == 0 || lucky_enabled() || frames_ != 0)
+                return;
+            fft_roi_ = calc_fft(frame,true);
+            reference_weight_ = 0;
+            frame_weight(frame);
+            has_reference_ = true;
+        }
+
+        ///
+        /// Lucky imaging: frames are collected in a window of \a window frames, scored by sharpness
+        /// and only best \a keep_percent of each window are stacked. If \a compact is set frames
+        /// are kept as 16 bit integers scaled to their own range while waiting in the window.
+        ///
+        void set_lucky(int window,float keep_percent,bool compact)
+        {
+            lucky_window_ = std::max(0,window);
+            lucky_keep_percent_ = std::max(1.0f,std::min(100.0f,keep_percent));
+            lucky_compact_ = compact;
+            lucky_ring_.clear();
+            lucky_ring_.reserve(lucky_window_);
+        }
+
+        bool lucky_enabled()
+        {
+            return lucky_window_ > 0;
+        }
+
+        /// number of frames waiting for selection
+        int lucky_pending()
+        {
+            return lucky_ring_.size();
+        }
+
+        /// process partially filled window, returns true if any frame was stacked
+        bool flush_lucky()
+        {
+            if(lucky_ring_.empty())
+                return false;
+            return process_lucky_window();
         }
 
         void set_remove_satellites(bool v)
@@ -99,11 +358,7 @@ namespace ols {
 
         void set_stretch(bool auto_stretch,float low_index,float high_index,float stretch_index)
         {
-            enable_stretch_ = auto_stretch;
-            
-            high_cut_ = std::max(1.0f,std::min(32.0f,high_index));
-            low_cut_  = std::min(high_cut_ - 0.001f,std::max(0.0f,low_index));
-            target_gamma_ = std::max(1.0f,std::min(8.0f,stretch_index));
+            stretch_.set(auto_stretch,low_index,high_index,stretch_index);
         }
 
         void make_fft_blur()
@@ -144,7 +399,21 @@ namespace ols {
         cv::Mat get_raw_stacked_image()
         {
             BOOSTER_INFO("stacked") << "So far stacked " << fully_stacked_count_ << std::endl;
-            if(remove_satellites_ && fully_stacked_count_ > 1) {
+            if(canvas_) {
+                stacked_res_ = canvas_->render();
+                BOOSTER_INFO("stacker") << "Canvas " << canvas_->bounds() << " in " << canvas_->tiles() << " tiles, " 
+                    << (canvas_->memory_bytes() >> 20) << "MB";
+                return stacked_res_;
+            }
+            if(!weight_.empty()) {
+                cv::Mat w = cv::max(weight_,1e-6f);
+                if(channels_ == 3) {
+                    cv::Mat ws[3] = {w,w,w};
+                    cv::merge(ws,3,w);
+                }
+                cv::divide(sum_,w,stacked_res_);
+            }
+            else if(remove_satellites_ && fully_stacked_count_ > 1) {
                 stacked_res_ = (sum_ - frame_max_) * (1.0/ (fully_stacked_count_ - 1));
             }
             else {
@@ -165,49 +434,6 @@ namespace ols {
             return time * 1000;
         }
 
-        float sum_rgb_line(float *p,int N,float line_sums[3])
-        {
-            float v[3]={};
-            float maxv=0;
-            int i=0;
-#ifdef USE_CV_SIMD
-            cv::v_float32x4 s[3];
-            s[0] = cv::v_setzero_f32();
-            s[1] = cv::v_setzero_f32();
-            s[2] = cv::v_setzero_f32();
-
-            int limit = N/12*12;
-            cv::v_float32x4 val;
-            for(;i<limit;i+=12,p+=12) {
-                cv::v_float32x4 c[3];
-                cv::v_load_deinterleave(p,c[0],c[1],c[2]);
-                s[0]+=c[0];
-                s[1]+=c[1];
-                s[2]+=c[2];
-
-                auto max_rgb = cv::v_reduce_max(cv::v_max(cv::v_max(c[0],c[1]),c[2]));
-                maxv = std::max(maxv,max_rgb);
-            }
-            v[0] = cv::v_reduce_sum(s[0]);
-            v[1] = cv::v_reduce_sum(s[1]);
-            v[2] = cv::v_reduce_sum(s[2]);
-#endif      
-            for(;i<N;i+=3) {
-                float c1=*p++;
-                float c2=*p++;
-                float c3=*p++;
-                maxv = std::max(std::max(maxv,c1),std::max(c2,c3));
-
-                v[0]+=c1;
-                v[1]+=c2;
-                v[2]+=c3;
-            }
-            for(int c=0;c<3;c++) {
-                line_sums[c]+=v[c];
-            }
-            return maxv;
-        }
-
         void scale_mono_and_clip(cv::Mat &m,float f1)
         {
             float *p = (float *)m.data;
@@ -315,29 +541,24 @@ namespace ols {
             
             tp start = std::chrono::high_resolution_clock::now();
             tp wb_coeff,wb_apply;
+            cv::Rect area = stacked_area();
             if(channels_ == 3) {
                 float scale[3];
-                calc_wb(tmp(fully_stacked_area_),scale);
+                calc_wb(tmp(area),scale,true);
                 wb_coeff = std::chrono::high_resolution_clock::now();
                 scale_rgb_and_clip(tmp,scale[0],scale[1],scale[2]);
                 wb_apply = std::chrono::high_resolution_clock::now();
             }
-            double gscale=1.0;
-            double goffset = 0.0;
-            double mean = 0.5;
-            float gamma_correction = 1.0f;
-
-            int N = calc_hist(tmp(fully_stacked_area_));
-            if(enable_stretch_) {
-                stretch(N,gscale,goffset,mean);
-                gamma_correction = cv::max(1.0,cv::min(gamma_limit_,log(mean)/log(mean_target_)));
-                BOOSTER_INFO("stacker") << "Stretch mean " << mean << "-> gamma=" << gamma_correction;
-            }
-            else {
-                gamma_correction = target_gamma_;
-                gscale = high_cut_;
-                goffset = -low_cut_ / gscale;
+            if(background_extraction_) {
+                background_ = BackgroundModel::fit(tmp,area);
+                if(!background_.empty())
+                    background_.subtract(tmp);
             }
+            calc_hist(tmp(area));
+            StretchInfo stretch = ols::calc_stretch(counters_,hist_bins,stretch_);
+            double gscale = stretch.gain;
+            double goffset = -stretch.cut / stretch.gain;
+            float gamma_correction = stretch.gamma;
             tp calc_stretch = std::chrono::high_resolution_clock::now();
             if(gamma_correction == 1.0) {
                 offset_scale_and_clip(tmp,goffset,gscale);
@@ -350,21 +571,59 @@ namespace ols {
             BOOSTER_INFO("stacker") << "get img=" << tdiff(raw,start) << "ms calc wb=" << tdiff(start,wb_coeff) <<"ms apply wb=" << tdiff(wb_coeff,wb_apply) << "ms calc stretch" << tdiff(wb_apply,calc_stretch) 
                 << "ms stretch="<<tdiff(calc_stretch,apply_stretch) << "ms";
 
-            StretchInfo stretch;
-            stretch.gamma = gamma_correction;
-            stretch.gain = gscale;
-            stretch.cut = - goffset * gscale;
-            stretch.auto_stretch = enable_stretch_;
             return std::make_pair(tmp,stretch);
         }
 
+        ///
+        /// White balanced linear image quantized to 16 bit and its luminance histogram over
+        /// the fully stacked area, stretch is left to the consumer
+        ///
+        std::pair<cv::Mat,std::vector<int> > get_preview_image()
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            cv::Mat tmp = get_raw_stacked_image();
+            cv::Rect area = stacked_area();
+            if(channels_ == 3) {
+                float scale[3];
+                calc_wb(tmp(area),scale);
+                scale_rgb_and_clip(tmp,scale[0],scale[1],scale[2]);
+            }
+            else {
+                scale_mono_and_clip(tmp,1.0f);
+            }
+            if(background_extraction_) {
+                // the cache keeps linear data, gradient is subtracted by the renderer
+                background_ = BackgroundModel::fit(tmp,area);
+                calc_hist(tmp(area),background_.empty() ? nullptr : &background_,area.tl());
+            }
+            else {
+                background_ = BackgroundModel();
+                calc_hist(tmp(area));
+            }
+            cv::Mat img16;
+            tmp.convertTo(img16,CV_MAKETYPE(CV_16U,channels_),65535.0);
+            auto end = std::chrono::high_resolution_clock::now();
+            BOOSTER_INFO("stacker") << "Preview image generation took " << tdiff(start,end) << "ms";
+            return std::make_pair(img16,get_histogramm());
+        }
+
         void handle_pause()
         {
-            if(rollback_on_pause_ && fully_stacked_count_ > 1) {
-                prev_sum_.copyTo(sum_);
-                fully_stacked_count_ = prev_fully_stacked_count_;
-                if(remove_satellites_) 
-                    prev_frame_max_.copyTo(frame_max_);
+            if(lucky_enabled()) {
+                // last frame can be taken while the mount moves, drop it from selection
+                if(rollback_on_pause_ && !lucky_ring_.empty())
+                    lucky_ring_.pop_back();
+                flush_lucky();
+                return;
+            }
+            if(rollback_on_pause_) {
+                int removed = 0;
+                while(!undo_.empty() && fully_stacked_count_ > 1 && removed < rollback_frames_) {
+                    undo_last();
+                    removed++;
+                }
+                undo_.clear();
+                BOOSTER_INFO("stacker") << "Rolled back " << removed << " frames";
             }
         }
         
@@ -385,18 +644,42 @@ namespace ols {
             if(window_size_ == 0) {
                 add_image(frame,cv::Point2f(0,0));
                 frames_ ++;
+                set_last_registered(frame,cv::Point2f(0,0));
                 return true;
             }
+            if(lucky_enabled()) {
+                LuckyFrame lf;
+                if(lucky_compact_) {
+                    // flat fielded frames exceed 1, scale to the actual range instead of clipping
+                    double minv = 0,maxv = 0;
+                    cv::minMaxLoc(frame.reshape(1),&minv,&maxv);
+                    lf.offset = minv;
+                    lf.scale = maxv > minv ? (maxv - minv) / 65535.0 : 1.0;
+                    frame.convertTo(lf.frame,CV_MAKETYPE(CV_16U,channels_),1.0 / lf.scale,-minv / lf.scale);
+                }
+                else
+                    lf.frame = frame;
+                // restart is requested until something is stacked, mark only first frame
+                lf.restart = restart_position && !lucky_restart_marked_;
+                lucky_restart_marked_ = restart_position;
+                lucky_ring_.push_back(std::move(lf));
+                if(int(lucky_ring_.size()) < lucky_window_)
+                    return false;
+                return process_lucky_window();
+            }
             bool added = true;
-            if(frames_ == 0) {
+            if(frames_ == 0 && !has_reference_) {
                 add_image(frame,cv::Point2f(0,0));
                 fft_roi_ = calc_fft(frame,true);
                 frames_ = 1;
                 reset_step(cv::Point2f(0,0));
+                set_last_registered(frame,cv::Point2f(0,0));
             }
             else {
                 cv::Mat fft_frame = calc_fft(frame,false);
-                cv::Point2f shift = get_dx_dy(fft_frame);
+                if(estimate_rotation_)
+                    derotate(frame,fft_frame);
+                cv::Point2f shift = get_dx_dy(fft_frame) + anchor_;
                 BOOSTER_INFO("stacker") <<"Registration at "<< frames_ <<":" << shift << std::endl;
                 if(restart_position) {
                     add_image(frame,shift);
@@ -412,17 +695,220 @@ namespace ols {
                         added = false;
                     }
                 }
+                if(added) {
+                    update_anchor(frame,shift);
+                    set_last_registered(frame,shift);
+                }
             }
             return added;
         }
+
+        ///
+        /// Frame and shift of the last frame stacked by stack_image, the frame is derotated if rotation
+        /// estimation is enabled. Not available in lucky imaging mode
+        ///
+        cv::Mat last_registered_frame()
+        {
+            return last_frame_;
+        }
+        cv::Point2f last_registered_shift()
+        {
+            return last_shift_;
+        }
+
+        ///
+        /// Stack a frame registered by another stacker of the same frame size, so several
+        /// products can share single registration
+        ///
+        void stack_registered(cv::Mat frame,cv::Point2f shift)
+        {
+            total_count_++;
+            add_image(frame,shift);
+            frames_++;
+        }
     private:
-        int calc_hist(cv::Mat img)
+        /// previous values of frame_max_ overwritten by a frame: sparse changes or a copy of the whole ROI
+        struct MaxUndo {
+            std::vector<std::pair<int,float> > changes; /// element index in frame_max_, previous value
+            cv::Mat prev;
+            cv::Rect rect;
+        };
+
+        void set_last_registered(cv::Mat frame,cv::Point2f shift)
+        {
+            last_frame_ = frame;
+            last_shift_ = shift;
+        }
+
+        struct LuckyFrame {
+            cv::Mat frame;
+            bool restart = false;
+            float score = 0;
+            cv::Point2f shift;
+            double scale = 1.0;     /// compact frame: value = stored * scale + offset
+            double offset = 0.0;
+        };
+
+        cv::Mat lucky_frame(LuckyFrame const &lf)
+        {
+            if(!lucky_compact_)
+                return lf.frame;
+            cv::Mat res;
+            lf.frame.convertTo(res,cv_type_,lf.scale,lf.offset);
+            return res;
+        }
+
+        /// variance of laplacian over registration ROI normalized by brightness
+        float sharpness(cv::Mat frame)
+        {
+            cv::Mat roi = cv::Mat(frame,cv::Rect(dx_,dy_,window_size_,window_size_));
+            cv::Mat gray,lap;
+            if(channels_ == 3) {
+                cv::Mat rgb[3];
+                cv::split(roi,rgb);
+                gray = rgb[1];
+            }
+            else {
+                gray = roi;
+            }
+            gray.convertTo(gray,CV_32FC1);
+            cv::Laplacian(gray,lap,CV_32F);
+            cv::Scalar mean,lap_mean,lap_std;
+            mean = cv::mean(gray);
+            cv::meanStdDev(lap,lap_mean,lap_std);
+            double m = std::max(1e-6,mean[0]);
+            return lap_std[0] * lap_std[0] / (m * m);
+        }
+
+        bool process_lucky_window()
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            int N = lucky_ring_.size();
+            cv::parallel_for_(cv::Range(0,N),[&](cv::Range const &range) {
+                for(int i=range.start;i<range.end;i++)
+                    lucky_ring_[i].score = sharpness(lucky_frame(lucky_ring_[i]));
+            });
+            std::vector<int> order(N);
+            for(int i=0;i<N;i++)
+                order[i] = i;
+            std::sort(order.begin(),order.end(),[&](int a,int b) { return lucky_ring_[a].score > lucky_ring_[b].score; });
+            int keep = std::max(1,int(std::ceil(N * lucky_keep_percent_ / 100.0f)));
+            std::vector<int> selected(order.begin(),order.begin() + keep);
+            std::sort(selected.begin(),selected.end());
+
+            bool first = frames_ == 0;
+            if(first) {
+                // the sharpest frame of the first window is the best reference
+                fft_roi_ = calc_fft(lucky_frame(lucky_ring_[order[0]]),true);
+            }
+            cv::parallel_for_(cv::Range(0,keep),[&](cv::Range const &range) {
+                for(int i=range.start;i<range.end;i++) {
+                    LuckyFrame &lf = lucky_ring_[selected[i]];
+                    lf.shift = get_dx_dy(calc_fft(lucky_frame(lf),false)) + anchor_;
+                }
+            });
+            auto scored = std::chrono::high_resolution_clock::now();
+
+            bool restart = first;
+            for(auto const &lf : lucky_ring_)
+                restart = restart || lf.restart;
+            int added = 0;
+            int last_added = -1;
+            for(int i=0;i<keep;i++) {
+                LuckyFrame &lf = lucky_ring_[selected[i]];
+                BOOSTER_INFO("stacker") <<"Lucky frame score " << lf.score << " registration at "<< frames_ <<":" << lf.shift;
+                if(restart) {
+                    reset_step(lf.shift);
+                    restart = false;
+                }
+                else if(!check_step(lf.shift)) {
+                    continue;
+                }
+                add_image(lucky_frame(lf),lf.shift);
+                frames_++;
+                added++;
+                last_added = selected[i];
+            }
+            if(last_added != -1)
+                update_anchor(lucky_frame(lucky_ring_[last_added]),lucky_ring_[last_added].shift);
+            auto end = std::chrono::high_resolution_clock::now();
+            BOOSTER_INFO("stacker") << "Lucky window of " << N << " frames: best score " << lucky_ring_[order[0]].score 
+                << " worst " << lucky_ring_[order[N-1]].score << ", stacked " << added << " of " << keep 
+                << ", scoring/registration " << tdiff(start,scored) << "ms stacking " << tdiff(scored,end) << "ms";
+            lucky_ring_.clear();
+            lucky_restart_marked_ = false;
+            return added > 0;
+        }
+
+        /// SNR of the frame: star signal (high percentile above median) over background noise (MAD)
+        float frame_snr(cv::Mat frame)
+        {
+            cv::Mat roi = cv::Mat(frame,cv::Rect(dx_,dy_,window_size_,window_size_));
+            int channel = channels_ == 3 ? 1 : 0;
+            // every other pixel of every other row is more than enough for the statistics
+            std::vector<float> samples;
+            samples.reserve((roi.rows / 2 + 1) * (roi.cols / 2 + 1));
+            for(int r=0;r<roi.rows;r+=2) {
+                float const *p = roi.ptr<float>(r) + channel;
+                for(int c=0;c<roi.cols;c+=2)
+                    samples.push_back(p[c*channels_]);
+            }
+            size_t N = samples.size();
+            if(N == 0)
+                return 0;
+            std::nth_element(samples.begin(),samples.begin() + N/2,samples.end());
+            float median = samples[N/2];
+            size_t high_index = std::min(N-1,size_t(N * 0.999));
+            std::nth_element(samples.begin(),samples.begin() + high_index,samples.end());
+            float signal = samples[high_index] - median;
+            for(auto &v : samples)
+                v = std::abs(v - median);
+            std::nth_element(samples.begin(),samples.begin() + N/2,samples.end());
+            float noise = std::max(1e-6f,1.4826f * samples[N/2]);
+            return std::max(0.0f,signal) / noise;
+        }
+
+        /// weight of the frame relatively to the first stacked one, 1 if weighting is disabled
+        float frame_weight(cv::Mat frame)
+        {
+            if(!frame_weighting_ || window_size_ == 0)
+                return 1.0f;
+            float snr = frame_snr(frame);
+            float w = snr * snr;
+            if(reference_weight_ <= 0) {
+                reference_weight_ = w;
+                if(w <= 0) 
+                    return 1.0f;
+            }
+            float rel = std::max(0.0f,std::min(10.0f,w / reference_weight_));
+            BOOSTER_INFO("stacker") << "Frame SNR " << snr << " weight " << rel;
+            return rel;
+        }
+
+        /// luminance histogram of \a img, if \a bg is given the gradient is subtracted on the fly,
+        /// \a origin is position of img within the image the model was fitted to
+        int calc_hist(cv::Mat img,BackgroundModel const *bg = nullptr,cv::Point origin = cv::Point())
         {
             memset(counters_,0,sizeof(counters_));
             int N=img.rows*img.cols;
+            std::vector<float> bg_row,corrected;
+            if(bg) {
+                bg_row.resize(bg->width * channels_);
+                corrected.resize(img.cols * channels_);
+            }
+            auto get_row = [&](int r) -> float * {
+                float *p = (float*)(img.data + img.step[0] * r);
+                if(!bg)
+                    return p;
+                bg->row(origin.y + r,bg_row.data());
+                float const *b = bg_row.data() + origin.x * channels_;
+                for(int i=0;i<img.cols * channels_;i++)
+                    corrected[i] = std::max(0.0f,std::min(1.0f,p[i] - b[i]));
+                return corrected.data();
+            };
             if(channels_ == 3) {
                 for(int r=0;r<img.rows;r++) {
-                    float *p = (float*)(img.data + img.step[0] * r);
+                    float *p = get_row(r);
                     for(int c=0;c<img.cols;c++) {
                         float R = *p++;
                         float G = *p++;
@@ -434,7 +920,7 @@ namespace ols {
             }
             else {
                 for(int r=0;r<img.rows;r++) {
-                    float *p = (float*)(img.data + img.step[0] * r);
+                    float *p = get_row(r);
                     for(int c=0;c<img.cols;c++) {
                         unsigned Y = (hist_bins-1) * *p++;
                         counters_[Y]++;
@@ -443,75 +929,162 @@ namespace ols {
             }
             return N;
         }
-        void stretch(int N,double &scale,double &offset,double &mean)
+        /// per channel background medians of every \a stride pixel of every \a stride row
+        void background_medians(cv::Mat img,int stride,float med[3],float *lum_sigma = nullptr)
         {
+            std::vector<float> samples[3];
+            for(int r=0;r<img.rows;r+=stride) {
+                float const *p = img.ptr<float>(r);
+                for(int c=0;c<img.cols;c+=stride) {
+                    for(int k=0;k<3;k++)
+                        samples[k].push_back(p[3*c+k]);
+                }
+            }
+            size_t N = samples[0].size();
+            if(N == 0) {
+                med[0]=med[1]=med[2]=0;
+                return;
+            }
+            if(lum_sigma) {
+                std::vector<float> lum(N);
+                for(size_t i=0;i<N;i++)
+                    lum[i] = 0.3f * samples[0][i] + 0.6f * samples[1][i] + 0.1f * samples[2][i];
+                std::nth_element(lum.begin(),lum.begin() + N/2,lum.end());
+                float lm = lum[N/2];
+                for(auto &v : lum)
+                    v = std::abs(v - lm);
+                std::nth_element(lum.begin(),lum.begin() + N/2,lum.end());
+                *lum_sigma = 1.4826f * lum[N/2];
+            }
+            for(int k=0;k<3;k++) {
+                std::nth_element(samples[k].begin(),samples[k].begin() + N/2,samples[k].end());
+                med[k] = samples[k][N/2];
+            }
+        }
 
-            int sum=N;
-            int hp=-1;
-            for(int i=hist_bins-1;i>=0;i--) {
-                sum-=counters_[i];
-                if(sum*100.0f/N <= high_per_) {
-                    hp = i;
-                    break;
+        ///
+        /// White balance from colors of detected stars, assuming average star is white. Candidates are
+        /// found on a sparse grid and climbed to the local peak, saturated stars are ignored.
+        /// Returns false if there are not enough stars
+        ///
+        bool stars_wb(cv::Mat img,float const bg[3],float sigma,float scale[3])
+        {
+            constexpr int grid = 4;
+            constexpr int rad = 2;
+            constexpr int max_stars = 200;
+            constexpr int min_stars = 10;
+            constexpr float saturation = 0.95f;
+            auto lum = [&](int r,int c) {
+                float const *p = img.ptr<float>(r) + 3*c;
+                return 0.3f * p[0] + 0.6f * p[1] + 0.1f * p[2];
+            };
+            float bg_lum = 0.3f * bg[0] + 0.6f * bg[1] + 0.1f * bg[2];
+            float threshold = bg_lum + std::max(1e-4f,10 * sigma);
+            std::vector<std::pair<float,cv::Point> > peaks;
+            for(int r=rad;r<img.rows-rad;r+=grid) {
+                for(int c=rad;c<img.cols-rad;c+=grid) {
+                    if(lum(r,c) < threshold)
+                        continue;
+                    cv::Point pt(c,r);
+                    float v = lum(r,c);
+                    for(bool moved = true;moved;) {
+                        moved = false;
+                        for(int dr=-1;dr<=1;dr++) {
+                            for(int dc=-1;dc<=1;dc++) {
+                                int nr = pt.y+dr, nc = pt.x+dc;
+                                if(nr < rad || nr >= img.rows - rad || nc < rad || nc >= img.cols - rad)
+                                    continue;
+                                float nv = lum(nr,nc);
+                                if(nv > v) {
+                                    v = nv;
+                                    pt = cv::Point(nc,nr);
+                                    moved = true;
+                                }
+                            }
+                        }
+                    }
+                    peaks.push_back(std::make_pair(v,pt));
                 }
             }
-            int end = hp / 2;
-            int max_diff = 0;
-            for(int i=0;i<end-1;i++) {
-                int diff = counters_[i+1] - counters_[i];
-                max_diff = std::max(diff,max_diff);
-            }
-            int lp = 0;
-            for(int i=0;i<end-1;i++) {
-                lp = i;
-                int diff = counters_[i+1] - counters_[i];
-                if(diff * 10 >= max_diff)
+            std::sort(peaks.begin(),peaks.end(),[](std::pair<float,cv::Point> const &a,std::pair<float,cv::Point> const &b) {
+                if(a.first != b.first)
+                    return a.first > b.first;
+                return a.second.y < b.second.y || (a.second.y == b.second.y && a.second.x < b.second.x);
+            });
+            // same star is reached from several grid points
+            peaks.erase(std::unique(peaks.begin(),peaks.end(),[](std::pair<float,cv::Point> const &a,std::pair<float,cv::Point> const &b) {
+                return a.second == b.second;
+            }),peaks.end());
+            std::vector<float> ratio[3];
+            for(auto const &pk : peaks) {
+                if(int(ratio[0].size()) >= max_stars)
                     break;
+                float flux[3] = {0,0,0};
+                bool saturated = false;
+                for(int r=pk.second.y - rad;r<=pk.second.y + rad;r++) {
+                    float const *p = img.ptr<float>(r);
+                    for(int c=pk.second.x - rad;c<=pk.second.x + rad;c++) {
+                        for(int k=0;k<3;k++) {
+                            saturated = saturated || p[3*c+k] >= saturation;
+                            flux[k] += p[3*c+k] - bg[k];
+                        }
+                    }
+                }
+                if(saturated || flux[0] <= 0 || flux[1] <= 0 || flux[2] <= 0)
+                    continue;
+                for(int k=0;k<3;k++)
+                    ratio[k].push_back(flux[1] / flux[k]);
+            }
+            int N = ratio[0].size();
+            if(N < min_stars)
+                return false;
+            for(int k=0;k<3;k++) {
+                std::nth_element(ratio[k].begin(),ratio[k].begin() + N/2,ratio[k].end());
+                scale[k] = ratio[k][N/2];
             }
-            scale = (hist_bins-1.0)/hp;
-            offset = -lp/(hist_bins - 1.0);
-            
-            mean = 0;
-            int total = 0;
-            for(int i=0;i<lp;i++) {
-                total += counters_[i];
-            }
-            for(int i=lp;i<=hp;i++) {
-                mean += (i - lp) / (hist_bins - 1.0) * counters_[i] * scale;
-                total += counters_[i];
-            }
-            for(int i=hp+1;i<hist_bins;i++) {
-                mean += counters_[i] * scale;
-                total += counters_[i];
-            }
-            mean = mean / total;
-            BOOSTER_INFO("stacker") << "Scale " << scale << " offset=" << (-offset) << " relative cut =" << (-offset*scale) ;
-        }
-
-        void calc_wb(cv::Mat img,float scale[3])
-        {
-            float *base = (float*)img.data;
-            int stride = img.step1(0);
-            int rows = img.rows;
-            int cols = img.cols;
-            float maxV = 0;
-            scale[0]=scale[1]=scale[2] = 0;
-            for(int r=0;r<rows;r++) {
-                float *p = base + stride*r;
-                float line_max = sum_rgb_line(p,cols*3,scale);
-                maxV = std::max(maxV,line_max);
-            }
-            // normalize once again
-            float smax = std::max(scale[0],std::max(scale[1],scale[2]));
             float smin = std::min(scale[0],std::min(scale[1],scale[2]));
-            if(smin > 0) {
-                for(int i=0;i<3;i++)
-                    scale[i] = smax / scale[i];
+            for(int k=0;k<3;k++)
+                scale[k] /= smin;
+            BOOSTER_INFO("stacker") << "Star color calibration using " << N << " stars";
+            return true;
+        }
+
+        ///
+        /// White balance that neutralizes background (or average star color if enabled), sampled
+        /// sparsely. The result is cached and recalculated every wb_update_interval stacked frames,
+        /// if background color drifts or if \a force is set
+        ///
+        void calc_wb(cv::Mat img,float scale[3],bool force = false)
+        {
+            constexpr int wb_update_interval = 10;
+            constexpr float wb_drift_limit = 0.02f;
+            constexpr int check_stride = 16;
+            constexpr int sample_stride = 4;
+            float quick[3];
+            background_medians(img,check_stride,quick);
+            bool valid = wb_count_ > 0 && fully_stacked_count_ - wb_count_ < wb_update_interval;
+            for(int k=0;valid && k<3;k++) {
+                float ref = std::max(1e-6f,wb_check_[k]);
+                valid = std::abs(quick[k] - wb_check_[k]) / ref <= wb_drift_limit;
             }
-            else {
-                for(int i=0;i<3;i++)
-                    scale[i] = 1.0;
+            if(valid && !force) {
+                for(int k=0;k<3;k++)
+                    scale[k] = wb_scale_[k];
+                return;
+            }
+            float bg[3],sigma = 0;
+            background_medians(img,sample_stride,bg,&sigma);
+            if(!wb_stars_ || !stars_wb(img,bg,sigma,scale)) {
+                float smax = std::max(bg[0],std::max(bg[1],bg[2]));
+                float smin = std::min(bg[0],std::min(bg[1],bg[2]));
+                for(int k=0;k<3;k++)
+                    scale[k] = smin > 0 ? smax / bg[k] : 1.0f;
             }
+            for(int k=0;k<3;k++) {
+                wb_scale_[k] = scale[k];
+                wb_check_[k] = quick[k];
+            }
+            wb_count_ = std::max(1,fully_stacked_count_);
             BOOSTER_INFO("stacker") << "WB " << scale[0]<<"," << scale[1] << "," << scale[2];
         }
 
@@ -683,6 +1256,9 @@ namespace ols {
             }
             cv::dft(gray,dft,cv::DFT_COMPLEX_OUTPUT);
             if(first_frame) {
+                // rotation reference uses the spectrum before blur, same as the compared frames
+                if(estimate_rotation_)
+                    log_polar_ref_ = log_polar_dft(dft);
                 cv::mulSpectrums(dft,fft_kern_,dft,0);
             }
 #ifdef DEBUG
@@ -701,12 +1277,123 @@ namespace ols {
             return dft;
         }
 
+        ///
+        /// Log-polar transform of the magnitude spectrum of ROI \a dft returned as its own DFT.
+        /// The magnitude does not depend on translation, rotation of the image rotates it and scaling
+        /// scales it inversely, so both become shifts along angle (rows) and log radius (columns)
+        ///
+        cv::Mat log_polar_dft(cv::Mat const &dft)
+        {
+            int W = window_size_;
+            cv::Mat mag(W,W,CV_32FC1);
+            for(int r=0;r<W;r++) {
+                int fr = fft_pos(r);
+                float *dst = mag.ptr<float>((r + W/2) % W);
+                std::complex<float> const *src = dft.ptr<std::complex<float> >(r);
+                for(int c=0;c<W;c++) {
+                    int fc = fft_pos(c);
+                    float v = 0;
+                    // the axes carry the ROI border discontinuity that does not rotate with the image
+                    if(std::abs(fr) > 1 && std::abs(fc) > 1) {
+                        // high-pass emphasis, low frequencies are dominated by background and vignetting
+                        float x = std::cos(float(M_PI) * fr / W) * std::cos(float(M_PI) * fc / W);
+                        v = std::log1p(std::abs(src[c])) * (1 - x) * (2 - x);
+                    }
+                    dst[(c + W/2) % W] = v;
+                }
+            }
+            cv::Mat lp,res;
+            cv::warpPolar(mag,lp,cv::Size(W,W),cv::Point2f(W/2,W/2),W/2,cv::INTER_LINEAR | cv::WARP_POLAR_LOG);
+            cv::dft(lp,res,cv::DFT_COMPLEX_OUTPUT);
+            return res;
+        }
+
+        ///
+        /// Rotation in degrees (counter-clockwise on screen) and scale of the frame with spectrum \a dft
+        /// relatively to the reference. The magnitude spectrum is symmetric so the angle is in [-90,90]
+        ///
+        void estimate_rotation(cv::Mat const &dft,float &angle,float &scale)
+        {
+            int W = window_size_;
+            cv::Mat cur = log_polar_dft(dft);
+            cv::Mat spec,corr;
+            calcPC(log_polar_ref_,cur,spec);
+            cv::idft(spec,corr,cv::DFT_REAL_OUTPUT);
+            cv::Point pos;
+            cv::minMaxLoc(corr,nullptr,nullptr,nullptr,&pos);
+            cv::Point2f p = fft_pos2d(fft_pos(pos.y),fft_pos(pos.x),corr);
+            float rows = p.y;
+            if(rows > W / 4.0f)
+                rows -= W / 2.0f;
+            else if(rows < -W / 4.0f)
+                rows += W / 2.0f;
+            angle = rows * 360.0f / W;
+            scale = std::exp(p.x * std::log(W / 2.0f) / W);
+        }
+
+        ///
+        /// Estimate rotation and scale of \a frame and warp it to the reference, \a fft_frame is
+        /// recalculated for translation registration if the frame was changed
+        ///
+        void derotate(cv::Mat &frame,cv::Mat &fft_frame)
+        {
+            float angle,scale;
+            estimate_rotation(fft_frame,angle,scale);
+            // focus and seeing change the spectrum radius a little, larger values are misdetections
+            if(std::abs(scale - 1.0f) > 0.05f) {
+                BOOSTER_WARNING("stacker") << "Ignoring unlikely scale estimation " << scale;
+                scale = 1.0f;
+            }
+            BOOSTER_INFO("stacker") << "Rotation at " << frames_ << ": " << angle << " deg, scale " << scale;
+            if(std::abs(angle) < 0.02f && std::abs(scale - 1.0f) < 1e-4f)
+                return;
+            cv::Point2f center(dx_ + window_size_ / 2.0f,dy_ + window_size_ / 2.0f);
+            cv::Mat M = cv::getRotationMatrix2D(center,-angle,1.0 / scale);
+            cv::Mat rotated;
+            cv::warpAffine(frame,rotated,M,frame.size(),cv::INTER_LINEAR,cv::BORDER_CONSTANT);
+            frame = rotated;
+            fft_frame = calc_fft(frame,false);
+        }
+
+        ///
+        /// In canvas mode the target drifts away from the registration ROI of the reference frame,
+        /// once the drift exceeds quarter of the window, the current frame becomes new reference
+        /// and its position is used as an offset for all following registrations
+        ///
+        void update_anchor(cv::Mat frame,cv::Point2f shift)
+        {
+            if(!canvas_)
+                return;
+            cv::Point2f d = shift - anchor_;
+            float limit = window_size_ / 4.0f;
+            if(std::abs(d.x) <= limit && std::abs(d.y) <= limit)
+                return;
+            fft_roi_ = calc_fft(frame,true);
+            anchor_ = shift;
+            BOOSTER_INFO("stacker") << "Registration reference re-anchored at " << anchor_;
+        }
+
+        /// fully stacked area in output image coordinates
+        cv::Rect stacked_area()
+        {
+            if(canvas_) {
+                // the area covered by the latest frame is fully stacked relatively to its surrounding
+                cv::Rect bounds = canvas_->bounds();
+                cv::Rect frame(canvas_position_ - bounds.tl(),frame_size_);
+                return frame & cv::Rect(0,0,bounds.width,bounds.height);
+            }
+            if(drizzle_scale_ == 1)
+                return fully_stacked_area_;
+            int s = drizzle_scale_;
+            return cv::Rect(fully_stacked_area_.x * s,fully_stacked_area_.y * s,fully_stacked_area_.width * s,fully_stacked_area_.height * s);
+        }
+
         void calc_stacked_area(cv::Point shift)
         {
             int dx = round(shift.x);
             int dy = round(shift.y);
-            int width  = (sum_.cols - std::abs(dx));
-            int height = (sum_.rows - std::abs(dy));
+            int width  = (sum_.cols / drizzle_scale_ - std::abs(dx));
+            int height = (sum_.rows / drizzle_scale_ - std::abs(dy));
             cv::Rect src_rect = cv::Rect(std::max(dx,0),std::max(dy,0),width,height);
             fully_stacked_area_ = fully_stacked_area_ & src_rect;
         }
@@ -757,31 +1444,251 @@ namespace ols {
             fully_stacked_count_++;
         }
 #else    
-        void add_image_upscaled(cv::Mat img,cv::Point shift)
+        /// sum += weight * img and weight map += weight in a single pass over the rows
+        void accumulate_weighted(cv::Mat sum,cv::Mat wsum,cv::Mat img,float weight)
+        {
+            int W = img.cols;
+            cv::parallel_for_(cv::Range(0,img.rows),[&](cv::Range const &range) {
+                for(int y=range.start;y<range.end;y++) {
+                    float const *src = img.ptr<float>(y);
+                    float *dst = sum.ptr<float>(y);
+                    float *wdst = wsum.ptr<float>(y);
+                    if(channels_ == 3) {
+                        for(int x=0;x<W;x++) {
+                            dst[3*x+0] += weight * src[3*x+0];
+                            dst[3*x+1] += weight * src[3*x+1];
+                            dst[3*x+2] += weight * src[3*x+2];
+                            wdst[x] += weight;
+                        }
+                    }
+                    else {
+                        for(int x=0;x<W;x++) {
+                            dst[x] += weight * src[x];
+                            wdst[x] += weight;
+                        }
+                    }
+                }
+            });
+        }
+
+        ///
+        /// update frame max recording previous values of changed elements, once they pass a quarter of
+        /// the max (early in the stack most pixels change) the whole previous ROI is kept instead
+        ///
+        void update_frame_max(cv::Mat img,cv::Rect src_rect,cv::Rect img_rect,MaxUndo *undo)
+        {
+            cv::Mat max_roi = cv::Mat(frame_max_,src_rect);
+            if(!undo) {
+                max_roi = cv::max(max_roi,cv::Mat(img,img_rect));
+                return;
+            }
+            size_t limit = frame_max_.total() * channels_ / 4;
+            int N = img_rect.width * channels_;
+            int row_size = frame_max_.cols * channels_;
+            for(int r=0;r<img_rect.height;r++) {
+                float const *src = img.ptr<float>(img_rect.y + r) + img_rect.x * channels_;
+                int base = (src_rect.y + r) * row_size + src_rect.x * channels_;
+                float *dst = frame_max_.ptr<float>(src_rect.y + r) + src_rect.x * channels_;
+                for(int i=0;i<N;i++) {
+                    if(src[i] > dst[i]) {
+                        undo->changes.push_back(std::make_pair(base + i,dst[i]));
+                        dst[i] = src[i];
+                    }
+                }
+                if(undo->changes.size() > limit) {
+                    restore_frame_max(*undo);
+                    undo->changes = std::vector<std::pair<int,float> >();
+                    undo->prev = max_roi.clone();
+                    undo->rect = src_rect;
+                    max_roi = cv::max(max_roi,cv::Mat(img,img_rect));
+                    return;
+                }
+            }
+        }
+
+        void restore_frame_max(MaxUndo const &undo)
         {
-            if(rollback_on_pause_ && fully_stacked_count_ >= 1) {
-                sum_.copyTo(prev_sum_);
-                prev_fully_stacked_count_ = fully_stacked_count_;
-                if(remove_satellites_) 
-                    frame_max_.copyTo(prev_frame_max_);
+            if(!undo.prev.empty()) {
+                undo.prev.copyTo(cv::Mat(frame_max_,undo.rect));
+                return;
             }
+            float *max_data = frame_max_.ptr<float>();
+            // restore in reverse order, an element may be recorded once per frame only
+            for(auto p = undo.changes.rbegin();p != undo.changes.rend();++p)
+                max_data[p->first] = p->second;
+        }
+
+        void add_image_upscaled(cv::Mat img,cv::Point shift,float weight,MaxUndo *max_undo = nullptr)
+        {
             int dx = shift.x;
             int dy = shift.y;
             int width  = (sum_.cols - std::abs(dx));
             int height = (sum_.rows - std::abs(dy));
             cv::Rect src_rect = cv::Rect(std::max(dx,0),std::max(dy,0),width,height);
             cv::Rect img_rect = cv::Rect(std::max(-dx,0),std::max(-dy,0),width,height);
-            cv::Mat(sum_,src_rect) += cv::Mat(img,img_rect);
-            if(remove_satellites_) {
-                cv::Mat max_roi = cv::Mat(frame_max_,src_rect);
-                max_roi = cv::max(max_roi,cv::Mat(img,img_rect));
+            if(!weight_.empty())
+                accumulate_weighted(cv::Mat(sum_,src_rect),cv::Mat(weight_,src_rect),cv::Mat(img,img_rect),weight);
+            else if(weight < 0)
+                cv::Mat(sum_,src_rect) -= cv::Mat(img,img_rect);
+            else
+                cv::Mat(sum_,src_rect) += cv::Mat(img,img_rect);
+            if(remove_satellites_ && weight > 0)
+                update_frame_max(img,src_rect,img_rect,max_undo);
+        }
+
+        ///
+        /// Keep contribution of the frame just added for rollback. The previous newest record is
+        /// compacted to 16 bit, scaled to its range since flat fielded values exceed 1
+        ///
+        void record_undo(cv::Mat img,cv::Point shift,cv::Point2f drizzle_shift,float weight,MaxUndo &&max_undo)
+        {
+            if(!undo_.empty() && undo_.back().frame.depth() == CV_32F) {
+                UndoRecord &prev = undo_.back();
+                double minv = 0,maxv = 0;
+                cv::minMaxLoc(prev.frame.reshape(1),&minv,&maxv);
+                prev.offset = minv;
+                prev.scale = maxv > minv ? (maxv - minv) / 65535.0 : 1.0;
+                cv::Mat compact;
+                prev.frame.convertTo(compact,CV_MAKETYPE(CV_16U,prev.frame.channels()),1.0 / prev.scale,-minv / prev.scale);
+                prev.frame = compact;
+            }
+            UndoRecord r;
+            r.frame = img;
+            r.shift = shift;
+            r.drizzle_shift = drizzle_shift;
+            r.weight = weight;
+            r.max_undo = std::move(max_undo);
+            undo_.push_back(std::move(r));
+            while(int(undo_.size()) > rollback_frames_)
+                undo_.pop_front();
+        }
+
+        /// remove the most recent recorded frame from the accumulator
+        void undo_last()
+        {
+            UndoRecord &r = undo_.back();
+            cv::Mat frame = r.frame;
+            if(frame.depth() != CV_32F)
+                r.frame.convertTo(frame,cv_type_,r.scale,r.offset);
+            if(drizzle_scale_ > 1) {
+                add_image_drizzle(frame,r.drizzle_shift,-r.weight);
+            }
+            else {
+                add_image_upscaled(frame,r.shift,-r.weight);
+                if(remove_satellites_)
+                    restore_frame_max(r.max_undo);
+            }
+            fully_stacked_count_--;
+            undo_.pop_back();
+        }
+
+        /// overlap of drop [start,start+size) with output cells, returns index of first cell
+        static int drop_weights(float start,float size,std::vector<float> &w)
+        {
+            int first = std::floor(start);
+            float end = start + size;
+            w.clear();
+            for(int cell = first;cell < end;cell++) {
+                float ov = std::min(end,float(cell + 1)) - std::max(start,float(cell));
+                w.push_back(std::max(0.0f,ov));
+            }
+            return first;
+        }
+
+        /// accumulate input rows [y0,y1)
+        void drizzle_rows(cv::Mat const &img,int y0,int y1,int bx,std::vector<float> const &wx,int by,std::vector<float> const &wy)
+        {
+            int s = drizzle_scale_;
+            int W = img.cols;
+            int out_w = sum_.cols;
+            int out_h = sum_.rows;
+            for(int y=y0;y<y1;y++) {
+                float const *src = img.ptr<float>(y);
+                for(size_t ky=0;ky<wy.size();ky++) {
+                    int oy = y*s + by + int(ky);
+                    if(oy < 0 || oy >= out_h)
+                        continue;
+                    float *dst = sum_.ptr<float>(oy);
+                    float *wdst = weight_.ptr<float>(oy);
+                    for(size_t kx=0;kx<wx.size();kx++) {
+                        float w = wy[ky] * wx[kx];
+                        if(w == 0) // negative weight removes a frame on rollback
+                            continue;
+                        int off = bx + int(kx);
+                        // keep x*s + off inside [0,out_w)
+                        int x_start = std::max(0,(-off + s - 1) / s);
+                        int x_end = std::min(W,(out_w - off + s - 1) / s);
+                        if(channels_ == 3) {
+                            for(int x=x_start;x<x_end;x++) {
+                                int ox = x*s + off;
+                                dst[3*ox+0] += w * src[3*x+0];
+                                dst[3*ox+1] += w * src[3*x+1];
+                                dst[3*ox+2] += w * src[3*x+2];
+                                wdst[ox] += w;
+                            }
+                        }
+                        else {
+                            for(int x=x_start;x<x_end;x++) {
+                                int ox = x*s + off;
+                                dst[ox] += w * src[x];
+                                wdst[ox] += w;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        void add_image_drizzle(cv::Mat img,cv::Point2f shift,float weight)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            int s = drizzle_scale_;
+            float drop = drizzle_pixfrac_ * s;
+            // translation only - footprint pattern is identical for all pixels
+            std::vector<float> wx,wy;
+            int bx = drop_weights((0.5f + shift.x) * s - drop / 2,drop,wx);
+            int by = drop_weights((0.5f + shift.y) * s - drop / 2,drop,wy);
+            for(auto &w : wx)
+                w *= weight;
+
+            // drops of neighboring input rows may share an output row, so process
+            // tiles of rows in two passes such that concurrent tiles never touch
+            constexpr int tile_rows = 32;
+            int tiles = (img.rows + tile_rows - 1) / tile_rows;
+            for(int pass = 0;pass < 2;pass++) {
+                int count = (tiles - pass + 1) / 2;
+                cv::parallel_for_(cv::Range(0,count),[&](cv::Range const &range) {
+                    for(int i=range.start;i<range.end;i++) {
+                        int y0 = (2*i + pass) * tile_rows;
+                        int y1 = std::min(img.rows,y0 + tile_rows);
+                        drizzle_rows(img,y0,y1,bx,wx,by,wy);
+                    }
+                });
             }
+            auto end = std::chrono::high_resolution_clock::now();
+            BOOSTER_INFO("stacker") << "Drizzle x" << s << " pixfrac=" << drizzle_pixfrac_ << " took " << tdiff(start,end) << "ms";
         }
 
         void add_image(cv::Mat img,cv::Point2f shift)
         {
+            float weight = frame_weight(img);
+            if(canvas_) {
+                canvas_position_ = cv::Point(round(shift.x),round(shift.y));
+                canvas_->add(img,canvas_position_,weight);
+                fully_stacked_count_++;
+                return;
+            }
+
             calc_stacked_area(cv::Point(shift.x,shift.y));
 
+            if(drizzle_scale_ > 1) {
+                add_image_drizzle(img,shift,weight);
+                if(rollback_on_pause_)
+                    record_undo(img,cv::Point(),shift,weight,MaxUndo());
+                fully_stacked_count_++;
+                return;
+            }
+
             float dx = round(shift.x * subpixel_factor_);
             float dy = round(shift.y * subpixel_factor_);
 
@@ -793,7 +1700,14 @@ namespace ols {
                 resized = img;
             }
 
-            add_image_upscaled(resized,cv::Point(dx,dy));
+            if(rollback_on_pause_) {
+                MaxUndo max_undo;
+                add_image_upscaled(resized,cv::Point(dx,dy),weight,&max_undo);
+                record_undo(resized,cv::Point(dx,dy),shift,weight,std::move(max_undo));
+            }
+            else {
+                add_image_upscaled(resized,cv::Point(dx,dy),weight);
+            }
 
             fully_stacked_count_++;
         }
@@ -807,8 +1721,16 @@ namespace ols {
         bool remove_satellites_ = false;
         cv::Mat frame_max_;
         cv::Mat sum_;
-        cv::Mat prev_sum_,prev_frame_max_;
-        int prev_fully_stacked_count_ = 0;
+        struct UndoRecord {
+            cv::Mat frame;
+            cv::Point shift;
+            cv::Point2f drizzle_shift;
+            float weight = 1.0f;
+            double scale = 1.0;     /// compact frame: value = stored * scale + offset
+            double offset = 0.0;
+            MaxUndo max_undo;
+        };
+        std::deque<UndoRecord> undo_;
         cv::Mat darks_;
         cv::Mat darks_gamma_corrected_;
         bool darks_corrected_ = false;
@@ -823,15 +1745,45 @@ namespace ols {
         int manual_exposure_counter_ = 0;
         int exp_multiplier_;
         cv::Mat manual_frame_;
-        bool enable_stretch_ = true;
-        float low_cut_ = 0.0f;
-        float high_cut_ = 1.0f;
-        float target_gamma_ = 2.2f;
+        StretchSettings stretch_;
 
         int channels_;
         int cv_type_;
 
         bool rollback_on_pause_ = false;
+        int rollback_frames_ = 0;
+
+        int drizzle_scale_ = 1;
+        float drizzle_pixfrac_ = 0.7f;
+        cv::Mat weight_;
+
+        int lucky_window_ = 0;
+        float lucky_keep_percent_ = 10.0f;
+        bool lucky_compact_ = false;
+        bool lucky_restart_marked_ = false;
+        std::vector<LuckyFrame> lucky_ring_;
+
+        std::unique_ptr<TiledCanvas> canvas_;
+        cv::Size frame_size_;
+        cv::Point canvas_position_;
+        cv::Point2f anchor_;
+
+        bool frame_weighting_ = false;
+        float reference_weight_ = 0;
+
+        bool background_extraction_ = false;
+        BackgroundModel background_;
+
+        bool wb_stars_ = false;
+        float wb_scale_[3] = {1,1,1};
+        float wb_check_[3] = {0,0,0};
+        int wb_count_ = 0;
+
+        bool estimate_rotation_ = false;
+        bool has_reference_ = false;
+        cv::Mat last_frame_;
+        cv::Point2f last_shift_;
+        cv::Mat log_polar_ref_;
 
         //float low_per_= 0.05;
         //float high_per_=99.999f;
@@ -18,11 +18,13 @@ namespace ols {
         StackerControlApp(cppcms::service &srv,
                           CameraInterface *iface,
                           std::string data_dir,
-                          queue_pointer_type queue): 
+                          queue_pointer_type queue,
+                          queue_pointer_type preview_queue = queue_pointer_type()): 
             ControlAppBase(srv),
             cam_(iface),
             data_dir_(data_dir),
-            queue_(queue)
+            queue_(queue),
+            preview_queue_(preview_queue)
         {
             stacked_path_ = data_dir_ + "/stacked";
             calibration_path_ = data_dir_ + "/calibration";
@@ -67,6 +69,9 @@ namespace ols {
             cmd->stretch_high = content_.get("stretch_high",cmd->stretch_high);
             cmd->stretch_gamma = content_.get("stretch_gamma",cmd->stretch_gamma);
             queue_->push(cmd);
+            // re-render preview right away rather than behind queued frames
+            if(preview_queue_)
+                preview_queue_->push(cmd);
         }
         void start()
         {
@@ -81,6 +86,9 @@ namespace ols {
             cmd->calibration = content_.get("type","dso") == "calibration";
             cmd->name = content_.get<std::string>("name");
             cmd->save_inputs = content_.get("save_data",false);
+            cmd->save_format = content_.get("save_format",cmd->save_format);
+            if(cmd->save_format != "files" && cmd->save_format != "ser")
+                throw std::runtime_error("Invalid save format " + cmd->save_format);
             if(!cmd->calibration) {
                 if(!cmd->name.empty())
                     cmd->name += "_";
@@ -112,6 +120,9 @@ namespace ols {
             cmd->derotate_mirror = content_.get("image_flip",cmd->derotate_mirror);
             cmd->derotate = content_.get("field_derotation",cmd->derotate);
             cmd->rollback_on_pause = content_.get("rollback_on_pause",cmd->rollback_on_pause);
+            cmd->rollback_frames = content_.get("rollback_frames",cmd->rollback_frames);
+            if(cmd->rollback_frames < 1 || cmd->rollback_frames > 16)
+                throw std::runtime_error("Invalid rollback_frames");
             cmd->darks_path = content_.get("darks",cmd->darks_path);
             cmd->flats_path = content_.get("flats",cmd->flats_path);
             cmd->dark_flats_path = content_.get("dark_flats",cmd->dark_flats_path);
@@ -120,6 +131,36 @@ namespace ols {
             cmd->stretch_high = content_.get("stretch_high",cmd->stretch_high);
             cmd->stretch_gamma = content_.get("stretch_gamma",cmd->stretch_gamma);
             cmd->remove_satellites = content_.get("remove_satellites",cmd->remove_satellites);
+            cmd->drizzle_scale = content_.get("drizzle.scale",cmd->drizzle_scale);
+            cmd->drizzle_pixfrac = content_.get("drizzle.pixfrac",cmd->drizzle_pixfrac);
+            if(cmd->drizzle_scale < 1 || cmd->drizzle_scale > 4 || cmd->drizzle_pixfrac <= 0 || cmd->drizzle_pixfrac > 1)
+                throw std::runtime_error("Invalid drizzle parameters");
+            cmd->lucky_window = content_.get("lucky.window",cmd->lucky_window);
+            cmd->lucky_keep_percent = content_.get("lucky.keep_percent",cmd->lucky_keep_percent);
+            cmd->lucky_compact = content_.get("lucky.compact",cmd->lucky_compact);
+            if(cmd->lucky_window < 0 || cmd->lucky_keep_percent <= 0 || cmd->lucky_keep_percent > 100)
+                throw std::runtime_error("Invalid lucky imaging parameters");
+            cmd->canvas = content_.get("canvas",cmd->canvas);
+            cmd->frame_weighting = content_.get("frame_weighting",cmd->frame_weighting);
+            cmd->background_extraction = content_.get("background_extraction",cmd->background_extraction);
+            cmd->wb_stars = content_.get("wb_stars",cmd->wb_stars);
+            cmd->estimate_rotation = content_.get("estimate_rotation",cmd->estimate_rotation);
+            cppcms::json::value const &outputs = content_.find("outputs");
+            if(outputs.type() == cppcms::json::is_array) {
+                for(auto const &o : outputs.array()) {
+                    StackerOutputConfig out;
+                    out.suffix = o.get<std::string>("suffix");
+                    out.channel = o.get("channel",out.channel);
+                    out.remove_satellites = o.get("remove_satellites",out.remove_satellites);
+                    out.frame_weighting = o.get("frame_weighting",out.frame_weighting);
+                    out.drizzle_scale = o.get("drizzle.scale",out.drizzle_scale);
+                    out.drizzle_pixfrac = o.get("drizzle.pixfrac",out.drizzle_pixfrac);
+                    if(out.suffix.empty() || out.suffix.find('/') != std::string::npos || out.channel < -1 || out.channel > 2
+                       || out.drizzle_scale < 1 || out.drizzle_scale > 4 || out.drizzle_pixfrac <= 0 || out.drizzle_pixfrac > 1)
+                        throw std::runtime_error("Invalid additional output parameters");
+                    cmd->outputs.push_back(out);
+                }
+            }
 
             if(!cmd->darks_path.empty())
                 cmd->darks_path = calibration_path_ + "/" + cmd->darks_path + ".tiff";
@@ -139,6 +180,7 @@ namespace ols {
         std::string stacked_path_;
         std::string calibration_path_;
         queue_pointer_type queue_;
+        queue_pointer_type preview_queue_;
         std::string status_ = "idle";
     };
 
@@ -149,8 +191,13 @@ namespace ols {
         {
             stream_ = sse::bounded_event_queue::create(srv.get_io_service(),16);
         }
-        void main(std::string /*url*/)
+        void main(std::string url)
         {
+            if(url == "/metrics") {
+                response().set_content_header("application/json");
+                response().out() << last_stats_;
+                return;
+            }
             stream_->accept(release_context());
         }
         std::function<void(data_pointer_type)> get_callback()
@@ -178,6 +225,13 @@ namespace ols {
                 info["stacked"] = data->stacked;
                 info["missed"] = data->missed;
                 info["dropped"] = data->dropped;
+                info["sdk_dropped"] = data->sdk_dropped;
+                info["gaps"] = data->gaps;
+                info["skipped"] = data->skipped;
+                info["capture_latency_ms"] = data->capture_latency_ms;
+                info["queue_latency_ms"] = data->queue_latency_ms;
+                info["queue_latency_max_ms"] = data->queue_latency_max_ms;
+                info["stacked_latency_ms"] = data->stacked_latency_ms;
                 info["since_saved_s" ] = data->since_saved_s;
                 info["histogramm"] = data->histogramm;
             }
@@ -189,10 +243,13 @@ namespace ols {
             else 
                 return;
             ss << info;
+            if(data)
+                last_stats_ = ss.str();
             stream_->enqueue(ss.str());
         }
     private:
         std::shared_ptr<sse::bounded_event_queue> stream_;
+        std::string last_stats_ = "{}";
     };
 };
 
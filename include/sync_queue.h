@@ -64,6 +64,19 @@ namespace ols {
             return res;
         }
 
+        /// non-blocking pop, returns false if the queue is empty
+        bool try_pop(T &res)
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            if(data_.empty())
+                return false;
+            res = data_.front();
+            data_.pop();
+            --items;
+            cond_has_room_.notify_one();
+            return true;
+        }
+
     private:
         size_t limit_;
         std::queue<T> data_;
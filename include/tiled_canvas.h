@@ -0,0 +1,122 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <map>
+#include <utility>
+
+namespace ols {
+
+    ///
+    /// Sparse accumulator over unbounded integer coordinate space, sum and coverage
+    /// are kept in square tiles allocated on first use, so memory is paid only
+    /// for the area actually covered by frames
+    ///
+    class TiledCanvas {
+    public:
+        TiledCanvas(int channels,int tile_size = 256) :
+            channels_(channels),
+            tile_size_(tile_size)
+        {
+        }
+
+        /// add \a img with its top-left corner at \a offset of canvas coordinates
+        void add(cv::Mat const &img,cv::Point offset,float weight = 1.0f)
+        {
+            cv::Rect area(offset.x,offset.y,img.cols,img.rows);
+            int tx0 = tile_index(area.x);
+            int tx1 = tile_index(area.x + area.width - 1);
+            int ty0 = tile_index(area.y);
+            int ty1 = tile_index(area.y + area.height - 1);
+            for(int ty = ty0;ty <= ty1;ty++) {
+                for(int tx = tx0;tx <= tx1;tx++) {
+                    cv::Rect tile_rect(tx * tile_size_,ty * tile_size_,tile_size_,tile_size_);
+                    cv::Rect common = tile_rect & area;
+                    if(common.empty())
+                        continue;
+                    Tile &t = get_tile(tx,ty);
+                    cv::Rect in_tile = common - tile_rect.tl();
+                    cv::Rect in_img = common - area.tl();
+                    if(weight == 1.0f) {
+                        t.sum(in_tile) += img(in_img);
+                        t.count(in_tile) += cv::Scalar::all(1.0);
+                    }
+                    else {
+                        cv::scaleAdd(img(in_img),weight,t.sum(in_tile),t.sum(in_tile));
+                        t.count(in_tile) += cv::Scalar::all(weight);
+                    }
+                }
+            }
+            bounds_ = bounds_.empty() ? area : (bounds_ | area);
+        }
+
+        /// bounding rectangle of everything added so far
+        cv::Rect bounds() const
+        {
+            return bounds_;
+        }
+
+        /// sum normalized by coverage for \a area, uncovered pixels are 0
+        cv::Mat render(cv::Rect area) const
+        {
+            cv::Mat res(area.height,area.width,CV_MAKETYPE(CV_32F,channels_));
+            res.setTo(0);
+            for(auto const &p : tiles_) {
+                cv::Rect tile_rect(p.first.second * tile_size_,p.first.first * tile_size_,tile_size_,tile_size_);
+                cv::Rect common = tile_rect & area;
+                if(common.empty())
+                    continue;
+                cv::Mat count = cv::max(p.second.count(common - tile_rect.tl()),1e-6f);
+                if(channels_ == 3) {
+                    cv::Mat c3[3] = {count,count,count};
+                    cv::merge(c3,3,count);
+                }
+                cv::Mat dst = res(common - area.tl());
+                cv::divide(p.second.sum(common - tile_rect.tl()),count,dst);
+            }
+            return res;
+        }
+
+        cv::Mat render() const
+        {
+            return render(bounds_);
+        }
+
+        size_t tiles() const
+        {
+            return tiles_.size();
+        }
+
+        size_t memory_bytes() const
+        {
+            return tiles_.size() * size_t(tile_size_) * tile_size_ * sizeof(float) * (channels_ + 1);
+        }
+
+    private:
+        struct Tile {
+            cv::Mat sum;
+            cv::Mat count;
+        };
+
+        int tile_index(int v) const
+        {
+            // floor division for negative coordinates
+            return v >= 0 ? v / tile_size_ : -((-v + tile_size_ - 1) / tile_size_);
+        }
+
+        Tile &get_tile(int tx,int ty)
+        {
+            Tile &t = tiles_[std::make_pair(ty,tx)];
+            if(t.sum.empty()) {
+                t.sum = cv::Mat(tile_size_,tile_size_,CV_MAKETYPE(CV_32F,channels_));
+                t.sum.setTo(0);
+                t.count = cv::Mat(tile_size_,tile_size_,CV_32FC1);
+                t.count.setTo(0);
+            }
+            return t;
+        }
+
+        int channels_;
+        int tile_size_;
+        cv::Rect bounds_;
+        std::map<std::pair<int,int>,Tile> tiles_; // key is (row,col) of tile
+    };
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include <string>
 #include <memory>
+#include <vector>
+#include <set>
 namespace ols {
     std::string ftime(std::string const &pattern,time_t ts);
     void make_dir(std::string const &path);
@@ -13,9 +15,18 @@ namespace ols {
         DirWatch(DirWatch const &) = delete;
         DirWatch &operator=(DirWatch const &) = delete;
         
+        /// returns single new file, or empty string on timeout
         std::string wait_for_new_file(int time_ms);
+        /// returns all new files reported by single read, empty on timeout
+        std::vector<std::string> wait_for_new_files(int time_ms);
+        /// complete regular files that existed in directory already, ordered by modification time.
+        /// Events queued up to the scan for these files are dropped, files still open for writing
+        /// are skipped and reported by their close event
+        std::vector<std::string> existing_files();
     private:
-        bool has_enough();
+        bool read_events(int time_ms);
+        /// queue file events from buffer, ignoring names in \a skip
+        void parse_events(int got_bytes,std::set<std::string> const *skip);
         int fd_;
         std::string dir_;
         struct data;
@@ -5,6 +5,8 @@
 #include <iostream>
 #include <atomic>
 #include <map>
+#include <vector>
+#include <condition_variable>
 #include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -139,19 +141,29 @@ namespace ols {
             return res;
         }
 
-        void handle_frame(CamStreamFormat format,std::vector<unsigned char> &buf)
+        double timestamp()
         {
             struct timeval tv;
             gettimeofday(&tv,nullptr);
+            double unix_timestamp = tv.tv_sec;
+            unix_timestamp += tv.tv_usec * 1e-6;
+            return unix_timestamp;
+        }
+
+        void handle_frame(CamStreamFormat format,std::vector<unsigned char> &buf,double ts)
+        {
             CamFrame frm;
-            frm.unix_timestamp = tv.tv_sec;
-            frm.unix_timestamp += tv.tv_usec * 1e-6;
+            frm.unix_timestamp = ts;
             frm.width = format.width;
             frm.height = format.height;
             frm.data = buf.data();
             frm.data_size = buf.size();
             frm.frame_counter = frame_counter_++;
             frm.format = format.format;
+            int sdk_dropped = 0;
+            if(ASIGetDroppedFrames(info_.CameraID,&sdk_dropped) != ASI_SUCCESS)
+                sdk_dropped = 0;
+            frm.dropped_frames = sdk_dropped + ring_dropped_;
             if((format.format == stream_raw16 || format.format == stream_raw8) && info_.IsColorCam) {
                 switch(info_.BayerPattern) {
                 case ASI_BAYER_RG : frm.bayer = bayer_rg; break;
@@ -234,25 +246,72 @@ namespace ols {
                 callback_ = callback;
             }
                 
+            size_t frame_size = format.width*format.height*bpp;
+            for(auto &slot : ring_)
+                slot.data.resize(frame_size);
+            capture_buf_.resize(frame_size);
+            dispatch_buf_.resize(frame_size);
+            ring_read_ = ring_filled_ = 0;
+            ring_dropped_ = 0;
+
             stream_active_ = 1;
-            thread_ = std::move(std::thread([=]() {
-                std::vector<unsigned char> buf(format.width*format.height*bpp);
-                while(true) {
-                    ASI_ERROR_CODE status = ASIGetVideoData(info_.CameraID,buf.data(),buf.size(),500); 
-                    if(status == ASI_SUCCESS) {
-                        handle_frame(format,buf);
-                    }
-                    else if(status == ASI_ERROR_TIMEOUT) {
-                        if(stream_active_ == 0)
-                            break;
-                        continue;
+            capture_done_ = false;
+            dispatch_thread_ = std::move(std::thread([=]() { dispatch(format); }));
+            thread_ = std::move(std::thread([=]() { capture(); }));
+        }
+
+        /// capture thread only fills buffers, so slow processing never delays ASIGetVideoData
+        void capture()
+        {
+            while(true) {
+                ASI_ERROR_CODE status = ASIGetVideoData(info_.CameraID,capture_buf_.data(),capture_buf_.size(),500); 
+                if(status == ASI_SUCCESS) {
+                    double ts = timestamp();
+                    std::unique_lock<std::mutex> guard(ring_lock_);
+                    if(ring_filled_ == ring_size) {
+                        // dispatcher is behind, overwrite the oldest frame
+                        ring_read_ = (ring_read_ + 1) % ring_size;
+                        ring_filled_--;
+                        ring_dropped_++;
                     }
-                    else {
+                    CaptureBuffer &slot = ring_[(ring_read_ + ring_filled_) % ring_size];
+                    slot.data.swap(capture_buf_);
+                    slot.ts = ts;
+                    ring_filled_++;
+                    ring_cond_.notify_one();
+                }
+                else if(status == ASI_ERROR_TIMEOUT) {
+                    if(stream_active_ == 0)
                         break;
-                    }
+                    continue;
                 }
-            }));
-            
+                else {
+                    break;
+                }
+            }
+            std::unique_lock<std::mutex> guard(ring_lock_);
+            capture_done_ = true;
+            ring_cond_.notify_one();
+        }
+
+        void dispatch(CamStreamFormat format)
+        {
+            while(true) {
+                double ts;
+                {
+                    std::unique_lock<std::mutex> guard(ring_lock_);
+                    while(ring_filled_ == 0 && !capture_done_)
+                        ring_cond_.wait(guard);
+                    if(ring_filled_ == 0)
+                        return;
+                    CaptureBuffer &slot = ring_[ring_read_];
+                    slot.data.swap(dispatch_buf_);
+                    ts = slot.ts;
+                    ring_read_ = (ring_read_ + 1) % ring_size;
+                    ring_filled_--;
+                }
+                handle_frame(format,dispatch_buf_,ts);
+            }
         }
 
         /// stop the stream - once function ends callback will not be called any more
@@ -271,6 +330,7 @@ namespace ols {
             }
             stream_active_=0;
             thread_.join();
+            dispatch_thread_.join();
         }
 
         /// list of camera controls that the camera supports
@@ -515,6 +575,23 @@ namespace ols {
         std::mutex lock_;
         frame_callback_type callback_; 
         std::thread thread_;
+
+        struct CaptureBuffer {
+            std::vector<unsigned char> data;
+            double ts = 0;
+        };
+        static constexpr int ring_size = 4;
+        // buffers owned by capture and dispatch threads, exchanged with ring slots under ring_lock_
+        std::vector<unsigned char> capture_buf_,dispatch_buf_;
+        // protected by ring_lock_
+        std::mutex ring_lock_;
+        std::condition_variable ring_cond_;
+        CaptureBuffer ring_[ring_size];
+        int ring_read_ = 0;
+        int ring_filled_ = 0;
+        bool capture_done_ = false;
+        std::atomic<int> ring_dropped_{0};
+        std::thread dispatch_thread_;
     };
  
 
@@ -0,0 +1,577 @@
+#include "native_solver.h"
+
+#include <opencv2/imgproc.hpp>
+#include <booster/log.h>
+
+#include <fstream>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <array>
+#include <map>
+#include <set>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <dirent.h>
+
+namespace ols {
+    namespace {
+        constexpr double deg2rad = M_PI / 180;
+
+        cv::Vec3d to_vec(double ra,double de)
+        {
+            double a = ra * deg2rad;
+            double d = de * deg2rad;
+            return cv::Vec3d(std::cos(d)*std::cos(a),std::cos(d)*std::sin(a),std::sin(d));
+        }
+
+        /// gnomonic projection to standard coordinates in degrees around ra0,de0
+        bool project(double ra,double de,double ra0,double de0,cv::Point2d &p)
+        {
+            double a = (ra - ra0) * deg2rad;
+            double d = de * deg2rad;
+            double d0 = de0 * deg2rad;
+            double D = std::sin(d)*std::sin(d0) + std::cos(d)*std::cos(d0)*std::cos(a);
+            if(D <= 0)
+                return false;
+            p.x = std::cos(d)*std::sin(a) / D / deg2rad;
+            p.y = (std::sin(d)*std::cos(d0) - std::cos(d)*std::sin(d0)*std::cos(a)) / D / deg2rad;
+            return true;
+        }
+
+        void deproject(cv::Point2d p,double ra0,double de0,double &ra,double &de)
+        {
+            double x = p.x * deg2rad;
+            double y = p.y * deg2rad;
+            double d0 = de0 * deg2rad;
+            double den = std::cos(d0) - y*std::sin(d0);
+            ra = ra0 + std::atan2(x,den) / deg2rad;
+            de = std::atan2(y*std::cos(d0) + std::sin(d0),std::sqrt(x*x + den*den)) / deg2rad;
+            if(ra < 0)
+                ra += 360;
+            else if(ra >= 360)
+                ra -= 360;
+        }
+
+        struct ImageStar {
+            cv::Point2d pos;
+            float flux;
+        };
+
+        float median(std::vector<float> &v)
+        {
+            size_t mid = v.size() / 2;
+            std::nth_element(v.begin(),v.begin() + mid,v.end());
+            return v[mid];
+        }
+
+        ///
+        /// Brightest local maxima 5 sigma above smooth background, centroided over 5x5 window.
+        /// Large images are binned first, it also hides Bayer pattern of raw frames
+        ///
+        std::vector<ImageStar> detect_stars(cv::Mat const &img,int max_stars)
+        {
+            cv::Mat gray;
+            if(img.channels() == 3)
+                cv::cvtColor(img,gray,cv::COLOR_BGR2GRAY);
+            else
+                gray = img;
+            gray.convertTo(gray,CV_32F);
+            int bin = 1;
+            while(gray.rows / bin > 1000)
+                bin *= 2;
+            cv::Mat small,smooth,coarse,bg;
+            if(bin > 1)
+                cv::resize(gray,small,cv::Size(gray.cols / bin,gray.rows / bin),0,0,cv::INTER_AREA);
+            else
+                small = gray;
+            cv::GaussianBlur(small,smooth,cv::Size(3,3),0.8);
+            cv::resize(small,coarse,cv::Size(std::max(1,small.cols / 32),std::max(1,small.rows / 32)),0,0,cv::INTER_AREA);
+            cv::resize(coarse,bg,small.size(),0,0,cv::INTER_LINEAR);
+            cv::Mat res = smooth - bg;
+
+            std::vector<float> samples;
+            for(int y=0;y<res.rows;y+=4) {
+                float const *p = res.ptr<float>(y);
+                for(int x=0;x<res.cols;x+=4)
+                    samples.push_back(p[x]);
+            }
+            if(samples.size() < 16)
+                return std::vector<ImageStar>();
+            float med = median(samples);
+            for(auto &v : samples)
+                v = std::abs(v - med);
+            float sigma = std::max(1e-6f,1.4826f * median(samples));
+            float threshold = med + 5 * sigma;
+            float support_threshold = med + 2 * sigma;
+
+            constexpr int R = 2;
+            std::vector<ImageStar> stars;
+            for(int y=R+1;y<res.rows-R-1;y++) {
+                float const *p = res.ptr<float>(y);
+                for(int x=R+1;x<res.cols-R-1;x++) {
+                    float v = p[x];
+                    if(v <= threshold)
+                        continue;
+                    bool is_max = true;
+                    int support = 0;
+                    for(int dy=-1;dy<=1 && is_max;dy++) {
+                        float const *q = res.ptr<float>(y+dy);
+                        for(int dx=-1;dx<=1;dx++) {
+                            if(dx == 0 && dy == 0)
+                                continue;
+                            float n = q[x+dx];
+                            // flat tops are reported once, at the first pixel in raster order
+                            if(n > v || (n == v && (dy < 0 || (dy == 0 && dx < 0)))) {
+                                is_max = false;
+                                break;
+                            }
+                            if(n > support_threshold)
+                                support++;
+                        }
+                    }
+                    // hot pixels have no support in neighbours
+                    if(!is_max || support < 3)
+                        continue;
+                    double sx = 0, sy = 0, sw = 0;
+                    for(int dy=-R;dy<=R;dy++) {
+                        float const *q = res.ptr<float>(y+dy);
+                        for(int dx=-R;dx<=R;dx++) {
+                            double w = q[x+dx] - med;
+                            if(w <= 0)
+                                continue;
+                            sx += w * (x + dx);
+                            sy += w * (y + dy);
+                            sw += w;
+                        }
+                    }
+                    ImageStar s;
+                    s.pos = cv::Point2d((sx / sw + 0.5) * bin - 0.5,(sy / sw + 0.5) * bin - 0.5);
+                    s.flux = sw;
+                    stars.push_back(s);
+                }
+            }
+            std::sort(stars.begin(),stars.end(),[](ImageStar const &a,ImageStar const &b) { return a.flux > b.flux; });
+            std::vector<ImageStar> res_stars;
+            double min_dist = 3.0 * bin;
+            for(auto const &s : stars) {
+                if(int(res_stars.size()) >= max_stars)
+                    break;
+                bool duplicate = false;
+                for(auto const &r : res_stars) {
+                    if(cv::norm(r.pos - s.pos) < min_dist) {
+                        duplicate = true;
+                        break;
+                    }
+                }
+                if(!duplicate)
+                    res_stars.push_back(s);
+            }
+            return res_stars;
+        }
+
+        ///
+        /// Star and its 3 nearest neighbours: 5 smaller distances relative to the largest one
+        /// do not depend on shift, rotation, scale and mirroring
+        ///
+        struct Quad {
+            float ratio[5];
+            double size;
+            cv::Point2d center;
+        };
+
+        std::vector<Quad> make_quads(std::vector<cv::Point2d> const &pts)
+        {
+            std::vector<Quad> quads;
+            int N = pts.size();
+            if(N < 4)
+                return quads;
+            std::set<std::array<int,4> > seen;
+            std::vector<std::pair<double,int> > dist(N);
+            for(int i=0;i<N;i++) {
+                for(int j=0;j<N;j++) {
+                    double d = j == i ? std::numeric_limits<double>::max() : cv::norm(pts[i] - pts[j]);
+                    dist[j] = std::make_pair(d,j);
+                }
+                std::partial_sort(dist.begin(),dist.begin() + 3,dist.end());
+                std::array<int,4> ids = {{ i, dist[0].second, dist[1].second, dist[2].second }};
+                std::sort(ids.begin(),ids.end());
+                if(!seen.insert(ids).second)
+                    continue;
+                double d[6];
+                int k = 0;
+                cv::Point2d center(0,0);
+                for(int a=0;a<4;a++) {
+                    center += pts[ids[a]];
+                    for(int b=a+1;b<4;b++)
+                        d[k++] = cv::norm(pts[ids[a]] - pts[ids[b]]);
+                }
+                std::sort(d,d+6,std::greater<double>());
+                if(d[5] <= 0)
+                    continue;
+                Quad q;
+                q.size = d[0];
+                for(k=0;k<5;k++)
+                    q.ratio[k] = d[k+1] / d[0];
+                q.center = center * 0.25;
+                quads.push_back(q);
+            }
+            std::sort(quads.begin(),quads.end(),[](Quad const &a,Quad const &b) { return a.ratio[0] < b.ratio[0]; });
+            return quads;
+        }
+
+        /// least squares dst.x = c0*x + c1*y + c2, dst.y = c3*x + c4*y + c5
+        bool fit_affine(std::vector<cv::Point2d> const &src,std::vector<cv::Point2d> const &dst,double coef[6])
+        {
+            int N = src.size();
+            if(N < 3)
+                return false;
+            cv::Mat A(N,3,CV_64F),bx(N,1,CV_64F),by(N,1,CV_64F);
+            for(int i=0;i<N;i++) {
+                A.at<double>(i,0) = src[i].x;
+                A.at<double>(i,1) = src[i].y;
+                A.at<double>(i,2) = 1;
+                bx.at<double>(i) = dst[i].x;
+                by.at<double>(i) = dst[i].y;
+            }
+            cv::Mat sx,sy;
+            if(!cv::solve(A,bx,sx,cv::DECOMP_SVD) || !cv::solve(A,by,sy,cv::DECOMP_SVD))
+                return false;
+            for(int i=0;i<3;i++) {
+                coef[i] = sx.at<double>(i);
+                coef[i+3] = sy.at<double>(i);
+            }
+            return true;
+        }
+
+        cv::Point2d apply(double const coef[6],cv::Point2d p)
+        {
+            return cv::Point2d(coef[0]*p.x + coef[1]*p.y + coef[2],coef[3]*p.x + coef[4]*p.y + coef[5]);
+        }
+
+        constexpr int max_image_stars = 150;
+        constexpr float quad_tolerance = 0.007f;
+        constexpr int min_matched_stars = 6;
+    }
+
+    AstapStarDB::AstapStarDB(std::string const &dir) :
+        dir_(dir)
+    {
+    }
+
+    bool AstapStarDB::empty()
+    {
+        build_index();
+        return areas_.empty();
+    }
+
+    template<typename F>
+    void AstapStarDB::read_area(std::string const &path,F on_star)
+    {
+        std::ifstream f(path,std::ifstream::binary);
+        if(!f)
+            throw std::runtime_error("Failed to open star database file " + path);
+        char header[110];
+        if(!f.read(header,sizeof(header)))
+            throw std::runtime_error("Invalid star database file " + path);
+        // last header byte is the record size, space for default 5 bytes records
+        int record_size = header[109] == ' ' ? 5 : (unsigned char)(header[109]);
+        if(record_size != 5 && record_size != 6)
+            throw std::runtime_error("Unsupported record size " + std::to_string(record_size) + " in " + path);
+        int dec9 = 0;
+        float mag = 0;
+        std::vector<unsigned char> buf(record_size * 4096);
+        while(f) {
+            f.read(reinterpret_cast<char *>(buf.data()),buf.size());
+            size_t n = f.gcount() / record_size;
+            for(size_t i=0;i<n;i++) {
+                unsigned char const *r = &buf[i * record_size];
+                int ra_raw = r[0] | (r[1] << 8) | (r[2] << 16);
+                if(ra_raw == 0xFFFFFF) {
+                    // magnitude group header: magnitude * 10 + 16 and the high signed byte of declination
+                    mag = (int(r[4]) - 16) * 0.1f;
+                    dec9 = int(r[3]) - 128;
+                    continue;
+                }
+                Star s;
+                s.ra = ra_raw * (360.0 / 0xFFFFFF);
+                s.de = (dec9 * 65536 + (r[4] << 8) + r[3]) * (90.0 / (128*256*256 - 1));
+                s.mag = mag;
+                if(!on_star(s))
+                    return;
+            }
+        }
+    }
+
+    void AstapStarDB::build_index()
+    {
+        if(indexed_)
+            return;
+        indexed_ = true;
+        std::unique_ptr<DIR,int(*)(DIR *)> dir(opendir(dir_.c_str()),closedir);
+        if(!dir)
+            return;
+        std::map<std::string,std::vector<std::string> > series;
+        struct dirent *de;
+        while((de = readdir(dir.get())) != nullptr) {
+            std::string name = de->d_name;
+            size_t pos = name.find('_');
+            size_t ext = name.rfind('.');
+            if(pos == std::string::npos || ext == std::string::npos)
+                continue;
+            std::string suffix = name.substr(ext);
+            if(suffix != ".1476" && suffix != ".290")
+                continue;
+            series[name.substr(0,pos)].push_back(dir_ + "/" + name);
+        }
+        if(series.empty())
+            return;
+        // deeper databases first, stars are read in magnitude order so depth costs little
+        std::string selected = series.begin()->first;
+        for(char const *id : {"g05","d05","d20","d50","d80"}) {
+            if(series.count(id))
+                selected = id;
+        }
+        // area geometry is taken from its brightest stars instead of the tiling scheme
+        constexpr int sample_size = 300;
+        for(auto const &path : series[selected]) {
+            try {
+                std::vector<cv::Vec3d> pts;
+                read_area(path,[&](Star const &s) {
+                    pts.push_back(to_vec(s.ra,s.de));
+                    return pts.size() < sample_size;
+                });
+                if(pts.empty())
+                    continue;
+                cv::Vec3d sum(0,0,0);
+                for(auto const &p : pts)
+                    sum += p;
+                Area a;
+                a.path = path;
+                a.center = sum / cv::norm(sum);
+                double max_dist = 0;
+                for(auto const &p : pts)
+                    max_dist = std::max(max_dist,std::acos(std::min(1.0,p.dot(a.center))));
+                a.radius = max_dist * 1.3 + 0.5 * deg2rad;
+                areas_.push_back(a);
+            }
+            catch(std::exception const &e) {
+                BOOSTER_WARNING("ols") << "Skipping star database file: " << e.what();
+            }
+        }
+        BOOSTER_INFO("ols") << "Native plate solver uses " << selected << " star database with " << areas_.size() << " areas";
+    }
+
+    std::vector<AstapStarDB::Star> AstapStarDB::stars(double ra,double de,double radius,int limit)
+    {
+        build_index();
+        cv::Vec3d c = to_vec(ra,de);
+        double r = radius * deg2rad;
+        double cos_r = std::cos(r);
+        std::vector<Star> res;
+        for(auto const &a : areas_) {
+            double dist = std::acos(std::max(-1.0,std::min(1.0,c.dot(a.center))));
+            if(dist > r + a.radius)
+                continue;
+            int count = 0;
+            read_area(a.path,[&](Star const &s) {
+                if(to_vec(s.ra,s.de).dot(c) < cos_r)
+                    return true;
+                res.push_back(s);
+                return ++count < limit;
+            });
+        }
+        std::stable_sort(res.begin(),res.end(),[](Star const &a,Star const &b) { return a.mag < b.mag; });
+        if(int(res.size()) > limit)
+            res.resize(limit);
+        return res;
+    }
+
+    NativePlateSolver::NativePlateSolver(std::string const &db_dir) :
+        db_(db_dir)
+    {
+    }
+
+    bool NativePlateSolver::available()
+    {
+        return !db_.empty();
+    }
+
+    PlateSolver::WCS NativePlateSolver::solve(cv::Mat const &img,double fov,double ra,double de,double radius,double timeout)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if(db_.empty())
+            throw std::runtime_error("No star database found");
+        int rows = img.rows;
+        int cols = img.cols;
+        std::vector<ImageStar> stars = detect_stars(img,max_image_stars);
+        if(stars.size() < 8)
+            throw std::runtime_error("Not enough stars detected");
+        // FITS pixel coordinates: 1 based, y axis up
+        std::vector<cv::Point2d> img_pts;
+        for(auto const &s : stars)
+            img_pts.push_back(cv::Point2d(s.pos.x + 1,rows - s.pos.y));
+        std::vector<Quad> img_quads = make_quads(img_pts);
+
+        double scale = fov / rows;
+        double field_radius = 0.5 * std::hypot(cols,rows) * scale;
+        double field_area = cols * scale * rows * scale;
+        int cat_limit = std::max(30,std::min(600,int(stars.size() * M_PI * field_radius * field_radius / field_area)));
+        // catalog for the whole search area is read once with the same density
+        double search = radius + field_radius;
+        double area_ratio = (search * search) / (field_radius * field_radius);
+        int total_limit = int(std::min(300000.0,cat_limit * area_ratio + cat_limit));
+        std::vector<AstapStarDB::Star> catalog = db_.stars(ra,de,search,total_limit);
+        std::vector<cv::Vec3d> catalog_vec;
+        for(auto const &s : catalog)
+            catalog_vec.push_back(to_vec(s.ra,s.de));
+        BOOSTER_INFO("ols") << "Native plate solver: " << stars.size() << " stars detected, " << catalog.size() << " catalog stars";
+
+        double cos_field = std::cos(field_radius * deg2rad);
+        double step = 0.5 * fov;
+        int rings = int(std::ceil(radius / step));
+        int tries = 0;
+        for(int ring=0;ring<=rings;ring++) {
+            double dist = ring * step;
+            int n = ring == 0 ? 1 : int(std::ceil(2 * M_PI * dist / step));
+            for(int k=0;k<n;k++) {
+                double passed = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - start).count();
+                if(passed > timeout)
+                    throw std::runtime_error("Native solver timeout after " + std::to_string(tries) + " positions");
+                tries++;
+                double a = 2 * M_PI * k / n;
+                double ra_c,de_c;
+                deproject(cv::Point2d(dist * std::cos(a),dist * std::sin(a)),ra,de,ra_c,de_c);
+
+                // brightest catalog stars around the position on its tangent plane
+                cv::Vec3d c = to_vec(ra_c,de_c);
+                std::vector<int> ids;
+                std::vector<cv::Point2d> cat_pts;
+                for(size_t i=0;i<catalog.size() && int(ids.size()) < cat_limit;i++) {
+                    cv::Point2d p;
+                    if(catalog_vec[i].dot(c) < cos_field || !project(catalog[i].ra,catalog[i].de,ra_c,de_c,p))
+                        continue;
+                    ids.push_back(i);
+                    cat_pts.push_back(p);
+                }
+                if(cat_pts.size() < 8)
+                    continue;
+                std::vector<Quad> cat_quads = make_quads(cat_pts);
+
+                std::vector<cv::Point2d> m_img,m_cat;
+                std::vector<double> m_scale;
+                for(auto const &qi : img_quads) {
+                    auto p = std::lower_bound(cat_quads.begin(),cat_quads.end(),qi.ratio[0] - quad_tolerance,
+                                              [](Quad const &q,float v) { return q.ratio[0] < v; });
+                    for(;p != cat_quads.end() && p->ratio[0] <= qi.ratio[0] + quad_tolerance;++p) {
+                        bool same = true;
+                        for(int r=1;r<5 && same;r++)
+                            same = std::abs(p->ratio[r] - qi.ratio[r]) <= quad_tolerance;
+                        double s = p->size / qi.size;
+                        if(!same || s < scale * 0.7 || s > scale * 1.4)
+                            continue;
+                        m_img.push_back(qi.center);
+                        m_cat.push_back(p->center);
+                        m_scale.push_back(s);
+                    }
+                }
+                if(m_scale.size() < 3)
+                    continue;
+                // keep quads agreeing on the scale
+                std::vector<double> sorted = m_scale;
+                std::nth_element(sorted.begin(),sorted.begin() + sorted.size() / 2,sorted.end());
+                double med_scale = sorted[sorted.size() / 2];
+                std::vector<cv::Point2d> src,dst;
+                for(size_t i=0;i<m_scale.size();i++) {
+                    if(std::abs(m_scale[i] / med_scale - 1) < 0.01) {
+                        src.push_back(m_img[i]);
+                        dst.push_back(m_cat[i]);
+                    }
+                }
+                double coef[6];
+                bool fitted = false;
+                for(int iter=0;iter<3 && src.size() >= 3;iter++) {
+                    if(!fit_affine(src,dst,coef))
+                        break;
+                    fitted = true;
+                    std::vector<double> res(src.size());
+                    for(size_t i=0;i<src.size();i++)
+                        res[i] = cv::norm(apply(coef,src[i]) - dst[i]);
+                    std::vector<double> tmp = res;
+                    std::nth_element(tmp.begin(),tmp.begin() + tmp.size() / 2,tmp.end());
+                    double limit = std::max(2 * med_scale,3 * tmp[tmp.size() / 2]);
+                    std::vector<cv::Point2d> src2,dst2;
+                    for(size_t i=0;i<src.size();i++) {
+                        if(res[i] <= limit) {
+                            src2.push_back(src[i]);
+                            dst2.push_back(dst[i]);
+                        }
+                    }
+                    if(src2.size() == src.size())
+                        break;
+                    src.swap(src2);
+                    dst.swap(dst2);
+                    fitted = false;
+                }
+                if(!fitted || src.size() < 3)
+                    continue;
+
+                // verify by individual stars
+                std::vector<std::pair<cv::Point2d,int> > pairs;
+                double match_dist = 3 * med_scale;
+                for(auto const &p : img_pts) {
+                    cv::Point2d s = apply(coef,p);
+                    int best = -1;
+                    double best_dist = match_dist;
+                    for(size_t j=0;j<cat_pts.size();j++) {
+                        double d = cv::norm(cat_pts[j] - s);
+                        if(d < best_dist) {
+                            best_dist = d;
+                            best = j;
+                        }
+                    }
+                    if(best >= 0)
+                        pairs.push_back(std::make_pair(p,ids[best]));
+                }
+                if(int(pairs.size()) < min_matched_stars)
+                    continue;
+
+                // final fit of star pairs around image center, tangent point moved to CRVAL
+                PlateSolver::WCS wcs;
+                wcs.crpix1 = (cols + 1) / 2.0;
+                wcs.crpix2 = (rows + 1) / 2.0;
+                deproject(apply(coef,cv::Point2d(wcs.crpix1,wcs.crpix2)),ra_c,de_c,wcs.crval1,wcs.crval2);
+                bool ok = true;
+                for(int iter=0;iter<2 && ok;iter++) {
+                    std::vector<cv::Point2d> s,d;
+                    for(auto const &pr : pairs) {
+                        cv::Point2d p;
+                        if(!project(catalog[pr.second].ra,catalog[pr.second].de,wcs.crval1,wcs.crval2,p))
+                            continue;
+                        s.push_back(pr.first - cv::Point2d(wcs.crpix1,wcs.crpix2));
+                        d.push_back(p);
+                    }
+                    double c2[6];
+                    ok = fit_affine(s,d,c2);
+                    if(!ok)
+                        break;
+                    wcs.cd1_1 = c2[0];
+                    wcs.cd1_2 = c2[1];
+                    wcs.cd2_1 = c2[3];
+                    wcs.cd2_2 = c2[4];
+                    double ra0 = wcs.crval1, de0 = wcs.crval2;
+                    deproject(cv::Point2d(c2[2],c2[5]),ra0,de0,wcs.crval1,wcs.crval2);
+                }
+                if(!ok)
+                    continue;
+                double passed = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - start).count();
+                BOOSTER_INFO("ols") << "Native plate solver: solved at " << wcs.crval1 << "," << wcs.crval2 << " with " << src.size()
+                    << " quads and " << pairs.size() << " stars after " << tries << " positions in " << passed << " s";
+                return wcs;
+            }
+        }
+        throw std::runtime_error("No solution found within search radius");
+    }
+}
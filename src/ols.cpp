@@ -11,6 +11,7 @@
 #include "plate_solver.h"
 #include "plate_solver_ctl_app.h"
 #include "astap_db_download_app.h"
+#include "preview_tiles_app.h"
 
 namespace ols {
 
@@ -107,6 +108,11 @@ void OpenLiveStacker::start_stream(CamStreamFormat format,double max_framerate)
         red=192;
     auto frame = generate_dummy_frame(format.width,format.height,c,red,green,blue);
     dropped_since_last_update_ = 0;
+    sdk_dropped_total_ = 0;
+    sdk_dropped_since_last_update_ = 0;
+    last_frame_counter_ = -1;
+    gaps_since_last_update_ = 0;
+    skipped_since_last_update_ = 0;
     video_generator_queue_->push(frame);
 
     cam().start_stream(format,[=](CamFrame const &cf) {
@@ -159,13 +165,15 @@ void OpenLiveStacker::init(std::string driver_name,int external_option)
     web_service_->applications_pool().mount(video_generator_app_,cppcms::mount_point("/video/live",0));
     web_service_->applications_pool().mount(stacked_video_generator_app_,cppcms::mount_point("/video/stacked",0));
     web_service_->applications_pool().mount(cppcms::create_pool<CameraControlApp>(this,video_generator_queue_),cppcms::mount_point("/camera((/.*)?)",1));
-    web_service_->applications_pool().mount(cppcms::create_pool<StackerControlApp>(this,data_dir_,video_generator_queue_),
+    web_service_->applications_pool().mount(cppcms::create_pool<StackerControlApp>(this,data_dir_,video_generator_queue_,preview_queue_),
                                             cppcms::mount_point("/stacker((/.*)?)",1),
                                             cppcms::app::asynchronous);
     web_service_->applications_pool().mount(cppcms::create_pool<AstapDBDownloadApp>(PlateSolver::db_path()),
                                             cppcms::mount_point("/astap_db((/.*)?)",1),
                                             cppcms::app::asynchronous);
-    web_service_->applications_pool().mount(stats_stream_app_,cppcms::mount_point("/updates",0));
+    web_service_->applications_pool().mount(stats_stream_app_,cppcms::mount_point("/updates((/.*)?)",1));
+    preview_tiles_.reset(new PreviewTiles());
+    web_service_->applications_pool().mount(cppcms::create_pool<PreviewTilesApp>(preview_tiles_),cppcms::mount_point("/stacked_tiles((/.*)?)",1));
     web_service_->applications_pool().mount(cppcms::create_pool<PlateSolverControlApp>(data_dir_),cppcms::mount_point("/plate_solver((/.*)?)",1));
 }
 
@@ -174,8 +182,22 @@ void OpenLiveStacker::init(std::string driver_name,int external_option)
 void OpenLiveStacker::handle_video_frame(CamFrame const &cf)
 {
     auto now = booster::ptime::now();
-    if(max_framerate_ > 0 && booster::ptime::to_number(now - last_frame_ts_) < 1.0/max_framerate_)
+    if(last_frame_counter_ >= 0 && cf.frame_counter > last_frame_counter_ + 1) {
+        int gap = cf.frame_counter - last_frame_counter_ - 1;
+        gaps_since_last_update_ += gap;
+        BOOSTER_WARNING("stacker") << "Frame counter gap of " << gap << " frames before frame #" << cf.frame_counter;
+    }
+    last_frame_counter_ = cf.frame_counter;
+    if(cf.dropped_frames > sdk_dropped_total_) {
+        sdk_dropped_since_last_update_ += cf.dropped_frames - sdk_dropped_total_;
+        BOOSTER_WARNING("stacker") << "Camera dropped " << (cf.dropped_frames - sdk_dropped_total_) << " frames, total " << cf.dropped_frames;
+    }
+    sdk_dropped_total_ = cf.dropped_frames;
+
+    if(max_framerate_ > 0 && booster::ptime::to_number(now - last_frame_ts_) < 1.0/max_framerate_) {
+        skipped_since_last_update_ ++;
         return;
+    }
     last_frame_ts_ = now;
 
     received_ ++;
@@ -193,6 +215,17 @@ void OpenLiveStacker::handle_video_frame(CamFrame const &cf)
     frame->source_frame = std::shared_ptr<VideoFrame>(new VideoFrame(cf.data,cf.data_size));
     frame->dropped = dropped_since_last_update_;
     dropped_since_last_update_ = 0;
+    frame->sdk_dropped = sdk_dropped_since_last_update_;
+    sdk_dropped_since_last_update_ = 0;
+    frame->gaps = gaps_since_last_update_;
+    gaps_since_last_update_ = 0;
+    frame->skipped = skipped_since_last_update_;
+    skipped_since_last_update_ = 0;
+    frame->enqueue_ts = booster::ptime::to_number(now);
+    double latency = frame->enqueue_ts - cf.unix_timestamp;
+    // drivers replaying recorded data report original capture time
+    if(latency >= 0 && latency < max_capture_latency)
+        frame->capture_latency = latency;
     video_generator_queue_->push(frame);
 }
 
@@ -203,12 +236,16 @@ void OpenLiveStacker::set_plate_solving_image(data_pointer_type p)
         return;
     
     cv::Mat ps_frame;
+    bool bayer = false;
     if(frame->format.format == stream_yuv2) // unsupported by ASTAP
         ps_frame = frame->frame;
-    else
+    else {
         ps_frame = frame->raw;
+        bayer = frame->format.format == stream_raw8 || frame->format.format == stream_raw16;
+    }
     
-    PlateSolver::set_image(ps_frame,frame->live_is_stretched);
+    // raw may point to the camera buffer, the frame keeps it alive
+    PlateSolver::set_image(ps_frame,frame->live_is_stretched,bayer,frame);
 }
 
 void OpenLiveStacker::run()
@@ -230,7 +267,13 @@ void OpenLiveStacker::run()
                                               stack_display_queue_,
                                               stacker_stats_queue_,
                                               plate_solving_queue_,
-                                              data_dir_));
+                                              data_dir_,
+                                              preview_queue_));
+    preview_thread_ = std::move(start_preview_renderer(preview_queue_,
+                                                       stack_display_queue_,
+                                                       plate_solving_queue_,
+                                                       data_dir_,
+                                                       preview_tiles_));
     try {
         web_service_->run();
     }
@@ -262,11 +305,13 @@ void OpenLiveStacker::stop()
     video_display_queue_.reset();
     debug_save_queue_.reset();
     stack_display_queue_.reset();
+    preview_queue_.reset();
 
     video_generator_thread_.join();
     debug_save_thread_.join();
     preprocessor_thread_.join();
     stacker_thread_.join();
+    preview_thread_.join();
 
     camera_.reset();
     driver_.reset();
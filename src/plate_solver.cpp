@@ -1,4 +1,6 @@
 #include "plate_solver.h"
+#include "native_solver.h"
+#include "process_runner.h"
 #include "tiffmat.h"
 #include "util.h"
 #include "live_stretch.h"
@@ -8,18 +10,13 @@
 #include <sstream>
 #include <stdexcept>
 #include <iostream>
+#include <chrono>
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
 
 #include <unistd.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <signal.h>
-#include <booster/posix_time.h>
 #include <booster/log.h>
 
 namespace ols {
@@ -30,13 +27,56 @@ namespace ols {
     {
         if(exe_.empty())
             exe_ = "astap_cli";
+        if(!db_.empty())
+            native_.reset(new NativePlateSolver(db_));
+    }
+    PlateSolver::~PlateSolver()
+    {
     }
     void PlateSolver::set_tempdir(std::string const &p) 
     {
         temp_dir_ = p;
     }
+    std::string PlateSolver::staging_dir()
+    {
+        // input image is written and read once, keep it in memory when possible
+        if(access("/dev/shm",W_OK) == 0)
+            return "/dev/shm";
+        return temp_dir_;
+    }
+    cv::Mat PlateSolver::prepare_image(cv::Mat const &img,bool bayer)
+    {
+        cv::Mat gray;
+        if(img.channels() == 3)
+            cv::cvtColor(img,gray,cv::COLOR_BGR2GRAY);
+        else
+            gray = img;
+        int bin = (gray.rows + solve_height - 1) / solve_height;
+        // even binning sums full RGGB cells, giving luminance without debayering
+        if(bayer && bin % 2 != 0)
+            bin++;
+        if(bin <= 1)
+            return gray;
+        // crop to a multiple of bin so INTER_AREA sums exact bin x bin cells
+        cv::Mat cropped = gray(cv::Rect(0,0,gray.cols / bin * bin,gray.rows / bin * bin));
+        cv::Mat binned;
+        cv::resize(cropped,binned,cv::Size(gray.cols / bin,gray.rows / bin),0,0,cv::INTER_AREA);
+        return binned;
+    }
     PlateSolver::Result PlateSolver::solve(std::string const &img_path,double fov,double ra,double de,double rad,double timeout)
     {
+        return make_result(solve_wcs(img_path,fov,ra,de,rad,timeout),ra,de);
+    }
+
+    PlateSolver::WCS PlateSolver::solve_wcs(std::string const &img_path,double fov,double ra,double de,double rad,double timeout)
+    {
+        ProcessRunner job(temp_dir_,"ols_astap");
+        return run_astap(job,img_path,fov,ra,de,rad,timeout);
+    }
+
+    PlateSolver::WCS PlateSolver::run_astap(ProcessRunner &job,std::string const &img_path,double fov,double ra,double de,double rad,double timeout)
+    {
+        std::string output = job.work_dir() + "/result";
         std::vector<std::string> cmd = {
             exe_,
            "-f",img_path,
@@ -44,48 +84,79 @@ namespace ols {
             "-ra",std::to_string(ra/15.0),
             "-spd",std::to_string(de+90),
             "-r",std::to_string(rad),
-            "-o",temp_dir_ + "/ols_astap_output"
+            "-o",output
         };
         if(!db_.empty()) {
             cmd.push_back("-d");
             cmd.push_back(db_);
         }
-        std::string res_file = temp_dir_ + "/ols_astap_output.ini";
-        std::remove(res_file.c_str());
-        int status = run(cmd,res_file,timeout);
-        switch(status) {
+        std::ostringstream cmd_str;
+        for(auto const &arg : cmd)
+            cmd_str << arg << " ";
+        BOOSTER_INFO("ols") << "Running plate solver, exe=" << exe_ << " for architecture=" << OLS_ARCH <<  " with following command: "<<cmd_str.str();
+        #ifdef ANDROID_SUPPORT
+        if(!exists(exe_)) {
+            BOOSTER_ERROR("ols") << "There is no such executable file " << exe_ << ". Is it x86/x86_64 android?";
+            throw std::runtime_error("The ASTAP isn't found, so such file " + exe_); 
+        }
+        #endif        
+        auto res = job.run(cmd,timeout);
+        if(res.timed_out)
+            throw std::runtime_error("Execution took too much time, current limit is " + std::to_string(timeout) +"s");
+        if(res.exit_code < 0)
+            throw std::runtime_error("Execution of the astap process failed");
+        if(res.exit_code != 0)
+            BOOSTER_INFO("ols") << "astap exited with " << res.exit_code << ", stdout: " << trim(res.out) << " stderr: " << trim(res.err);
+        std::string res_file = output + ".ini";
+        switch(res.exit_code) {
         case 0: break;
         case 1: 
             {
                 std::string err;
-                parse_ini(res_file,err);
+                if(exists(res_file))
+                    parse_ini(res_file,err);
                 throw std::runtime_error("Failed to find solution " + err);
             }
         case 2: throw std::runtime_error("Not enough stars detected");
         case 16:throw std::runtime_error("Error reading image file: " + img_path);
         case 32:throw std::runtime_error("No star database found " + db_);
         case 33:throw std::runtime_error("Error reading star database " + db_);
-        default:throw std::runtime_error("astap returned error code " + std::to_string(status));
+        case 127:throw std::runtime_error(trim(res.err));
+        default:throw std::runtime_error("astap returned error code " + std::to_string(res.exit_code) + " " + trim(res.err));
         }
-        return make_result(res_file,ra,de);
+        return read_wcs(res_file);
     }
 
-    PlateSolver::Result PlateSolver::make_result(std::string const &path,double ra,double de)
+    PlateSolver::WCS PlateSolver::read_wcs(std::string const &path)
     {
         std::string err;
         std::map<std::string,double> vals = parse_ini(path,err);
         if(!vals["PLTSOLVD"])
             throw std::runtime_error("Plate solving failed:" + err);
-        double x0 = get(vals,"CRPIX1");
-        double y0 = get(vals,"CRPIX2");
-        double ra0 = get(vals,"CRVAL1");
-        double de0 = get(vals,"CRVAL2");
+        WCS wcs;
+        wcs.crpix1 = get(vals,"CRPIX1");
+        wcs.crpix2 = get(vals,"CRPIX2");
+        wcs.crval1 = get(vals,"CRVAL1");
+        wcs.crval2 = get(vals,"CRVAL2");
+        wcs.cd1_1 = get(vals,"CD1_1");
+        wcs.cd1_2 = get(vals,"CD1_2");
+        wcs.cd2_1 = get(vals,"CD2_1");
+        wcs.cd2_2 = get(vals,"CD2_2");
+        return wcs;
+    }
+
+    PlateSolver::Result PlateSolver::make_result(WCS const &wcs,double ra,double de)
+    {
+        double x0 = wcs.crpix1;
+        double y0 = wcs.crpix2;
+        double ra0 = wcs.crval1;
+        double de0 = wcs.crval2;
         double delta_ra = (ra - ra0)*std::cos(de0/180*M_PI);
         double delta_de = de - de0;
-        double c11 = get(vals,"CD1_1");
-        double c12 = get(vals,"CD1_2");
-        double c21 = get(vals,"CD2_1");
-        double c22 = get(vals,"CD2_2");
+        double c11 = wcs.cd1_1;
+        double c12 = wcs.cd1_2;
+        double c21 = wcs.cd2_1;
+        double c22 = wcs.cd2_2;
 
         double D=1.0/(c11*c22 - c12*c21);
         double Mi[2][2] = {
@@ -149,6 +220,56 @@ namespace ols {
         return vals;
     }
 
+    double PlateSolver::elapsed(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - start).count();
+    }
+
+    PlateSolver::WCS PlateSolver::solve_wcs(cv::Mat const &img,double fov_deg,double ra,double de,double radius,double timeout)
+    {
+        if(native_ && native_->available() && fov_deg > 0) {
+            auto start = std::chrono::steady_clock::now();
+            try {
+                return native_->solve(img,fov_deg,ra,de,radius,timeout * native_timeout_share);
+            }
+            catch(std::exception const &e) {
+                BOOSTER_WARNING("ols") << "Native plate solver failed: " << e.what() << ", falling back to ASTAP";
+            }
+            timeout = std::max(1.0,timeout - elapsed(start));
+        }
+        ProcessRunner job(staging_dir(),"ols_astap");
+        std::string tiff = job.work_dir() + "/input.tiff";
+        save_tiff(img,tiff);
+        return run_astap(job,tiff,fov_deg,ra,de,radius,timeout);
+    }
+
+    bool PlateSolver::predict_center(cv::Mat const &img,double &ra,double &de)
+    {
+        if(last_image_.empty() || last_image_.size() != img.size())
+            return false;
+        cv::Mat cur,window;
+        img.convertTo(cur,CV_32F);
+        cv::createHanningWindow(window,img.size(),CV_32F);
+        double response = 0;
+        cv::Point2d shift = cv::phaseCorrelate(last_image_,cur,window,&response);
+        // field moved out of the previous frame, nothing to predict from
+        if(response < 0.1)
+            return false;
+        // image center was at -shift in previous frame, FITS y axis points up
+        double dx = -shift.x;
+        double dy = shift.y;
+        double xi  = last_wcs_.cd1_1 * dx + last_wcs_.cd1_2 * dy;
+        double eta = last_wcs_.cd2_1 * dx + last_wcs_.cd2_2 * dy;
+        de = last_wcs_.crval2 + eta;
+        ra = last_wcs_.crval1 + xi / std::cos(de / 180 * M_PI);
+        if(ra < 0)
+            ra += 360;
+        else if(ra >= 360)
+            ra -= 360;
+        BOOSTER_INFO("ols") << "Field shifted by " << shift << " px since last solution, response " << response;
+        return true;
+    }
+
     PlateSolver::Result PlateSolver::solve_and_mark(
             cv::Mat &img,bool do_stretch,
             std::string const &jpeg_with_marks,
@@ -156,11 +277,31 @@ namespace ols {
             double target_ra_deg,
             double target_de_deg,
             double search_radius_deg,
-            double timeout)
+            double timeout,
+            bool bayer,
+            bool refine)
     {
-        std::string tiff = temp_dir_ + "/ols_astap_input.tiff";
-        save_tiff(img,tiff);
-        auto r = solve(tiff,fov_deg,target_ra_deg,target_de_deg,search_radius_deg,timeout);
+        img = prepare_image(img,bayer);
+        WCS wcs;
+        bool solved = false;
+        double ra,de;
+        if(refine && predict_center(img,ra,de)) {
+            auto start = std::chrono::steady_clock::now();
+            BOOSTER_INFO("ols") << "Verifying predicted pointing " << ra << "," << de;
+            try {
+                wcs = solve_wcs(img,fov_deg,ra,de,0.5 * fov_deg,std::min(timeout,refine_timeout));
+                solved = true;
+            }
+            catch(std::exception const &e) {
+                BOOSTER_WARNING("ols") << "Refine failed: " << e.what() << ", running full search";
+            }
+            timeout = std::max(1.0,timeout - elapsed(start));
+        }
+        if(!solved)
+            wcs = solve_wcs(img,fov_deg,target_ra_deg,target_de_deg,search_radius_deg,timeout);
+        img.convertTo(last_image_,CV_32F);
+        last_wcs_ = wcs;
+        Result r = make_result(wcs,target_ra_deg,target_de_deg);
         if(img.channels() != 3) {
             cv::Mat tmp;
             cv::cvtColor(img,tmp,cv::COLOR_GRAY2BGR);
@@ -184,88 +325,6 @@ namespace ols {
     }
 
 
-    int PlateSolver::run(std::vector<std::string> &opts,std::string ini_path,double timeout_sec)
-    {
-        std::vector<char *> args;
-        std::ostringstream cmd;
-        #if 0 //ifdef ANDROID_SUPPORT - old workaround
-        // workaround of linker issue
-        char exe[128];
-        snprintf(exe,sizeof(exe),"/system/bin/linker%s",(sizeof(void*)==8 ? "64" : ""));
-        args.push_back(exe);
-        #else
-        char const *exe=exe_.c_str();
-        #endif
-        for(auto &opt: opts) {
-            args.push_back(&opt[0]);
-        }
-        for(char *arg : args) {
-            cmd << arg << " ";
-        }
-        BOOSTER_INFO("ols") << "Running plate solver, exe=" << exe << " for architecture=" << OLS_ARCH <<  " with following command: "<<cmd.str();
-        args.push_back(nullptr);
-        #ifdef ANDROID_SUPPORT
-        if(!exists(exe_)) {
-            BOOSTER_ERROR("ols") << "There is no such executable file " << exe_ << ". Is it x86/x86_64 android?";
-            throw std::runtime_error("The ASTAP isn't found, so such file " + exe_); 
-        }
-        #endif        
-        int child_pid = fork();
-        if(child_pid == 0) {
-            int in_fd = open("/dev/null",O_RDONLY);
-            int out_fd = open("/dev/null",O_WRONLY);
-            dup2(in_fd,0);
-            dup2(out_fd,1);
-            dup2(out_fd,2);
-            #ifdef ANDROID_SUPPORT
-            execv(exe,args.data());
-            #else
-            execvp(exe,args.data());
-            #endif
-            int err = errno;
-            std::ofstream f(ini_path);
-            f<<"PLTSOLVD=F\nERROR=exec of " << exe_ << " failed with: " << strerror(err);
-            f.close();
-            _exit(1);
-        }
-        else if(child_pid < 0) {
-            throw std::system_error(errno,std::generic_category(),"Failed to create process"); 
-        }
-        else {
-            int N = int(timeout_sec * 10);
-            int status = 0;
-            bool wait_done = false;
-            bool timeout = false;
-            for(int i=0;i<N+1;i++) {
-                booster::ptime::millisleep(100);
-                int r,opt = WNOHANG;
-                if(i >= N) {
-                    timeout = true;
-                    kill(child_pid,SIGKILL);
-                    opt = 0;
-                }
-                r = waitpid(child_pid,&status,opt);
-                int err = errno;
-                if(r == 0)
-                    continue;
-                if(r < 0)
-                    throw std::system_error(err,std::generic_category(),"wait failed"); 
-                if(r != child_pid)
-                    throw std::runtime_error("Unexpected wait returned!");
-                wait_done = true;
-                break;
-            }
-            if(!wait_done)
-                throw std::runtime_error("Failed to wait for process");
-            if(timeout)
-                throw std::runtime_error("Execution took too much time, current limit is " + std::to_string(timeout_sec) +"s");
-            if(!WIFEXITED(status))
-                throw std::runtime_error("Execution of the astap process failed");
-            return WEXITSTATUS(status);
-        }
-    }
-
-
     void PlateSolver::init(std::string const &db_path,std::string const &path_to_astap_cli,std::string const &temp_dir)
     {
         std::unique_lock<std::mutex> g(lock_);
@@ -281,12 +340,19 @@ namespace ols {
         return instance_->db_;
     }
     
-    void PlateSolver::set_image(cv::Mat img,bool do_stretch)
+    void PlateSolver::set_image(cv::Mat const &img,bool do_stretch,bool bayer,std::shared_ptr<void const> owner)
     {
-        cv::Mat img_copy = img.clone();
-        std::unique_lock<std::mutex> g(img_lock_);
-        image_.reset(new cv::Mat(img_copy));
-        do_stretch_ = do_stretch;
+        std::unique_ptr<cv::Mat> ref(new cv::Mat(img));
+        std::shared_ptr<void const> prev_owner;
+        {
+            std::unique_lock<std::mutex> g(img_lock_);
+            image_.swap(ref);
+            prev_owner.swap(image_owner_);
+            image_owner_ = std::move(owner);
+            do_stretch_ = do_stretch;
+            bayer_ = bayer;
+        }
+        // previous frame is released outside of the lock
     }
 
     PlateSolver::Result PlateSolver::solve_last_image( std::string const &jpeg_with_marks,
@@ -294,22 +360,27 @@ namespace ols {
                                         double ra,
                                         double de,
                                         double rad,
-                                        double timeout)
+                                        double timeout,
+                                        bool refine)
     {
         cv::Mat img;
+        std::shared_ptr<void const> owner;
         bool do_stretch;
+        bool bayer;
         {
             std::unique_lock<std::mutex> g(img_lock_);
             if(!image_)
                 throw std::runtime_error("No image was set");
             img = *image_;
+            owner = image_owner_;
             do_stretch = do_stretch_;
+            bayer = bayer_;
         }
         {
             std::unique_lock<std::mutex> g(lock_);
             if(!instance_)
                 throw std::runtime_error("plate solver is not ready");
-            return instance_->solve_and_mark(img,do_stretch,jpeg_with_marks,fov,ra,de,rad,timeout);
+            return instance_->solve_and_mark(img,do_stretch,jpeg_with_marks,fov,ra,de,rad,timeout,bayer,refine);
         }
     }
 
@@ -318,7 +389,9 @@ namespace ols {
     std::mutex PlateSolver::img_lock_;
     std::unique_ptr<PlateSolver> PlateSolver::instance_;
     std::unique_ptr<cv::Mat> PlateSolver::image_;
+    std::shared_ptr<void const> PlateSolver::image_owner_;
     bool PlateSolver::do_stretch_;
+    bool PlateSolver::bayer_;
 
 
 }
@@ -0,0 +1,78 @@
+#include "preview_tiles.h"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+namespace ols {
+
+    void PreviewTiles::update(cv::Mat img8)
+    {
+        int max_level = 0;
+        while((1 << max_level) < std::max(img8.cols,img8.rows))
+            max_level++;
+        std::unique_lock<std::mutex> guard(lock_);
+        info_.width = img8.cols;
+        info_.height = img8.rows;
+        info_.max_level = max_level;
+        info_.version++;
+        levels_.clear();
+        levels_.resize(max_level + 1);
+        levels_[max_level] = img8;
+        cache_.clear();
+    }
+
+    void PreviewTiles::clear()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        info_.width = info_.height = info_.max_level = 0;
+        info_.version++;
+        levels_.clear();
+        cache_.clear();
+    }
+
+    PreviewTiles::Info PreviewTiles::info()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        return info_;
+    }
+
+    cv::Mat PreviewTiles::level_image(int level)
+    {
+        if(!levels_[level].empty())
+            return levels_[level];
+        cv::Mat upper = level_image(level + 1);
+        int shift = info_.max_level - level;
+        int w = (info_.width + (1 << shift) - 1) >> shift;
+        int h = (info_.height + (1 << shift) - 1) >> shift;
+        cv::resize(upper,levels_[level],cv::Size(w,h),0,0,cv::INTER_AREA);
+        return levels_[level];
+    }
+
+    std::shared_ptr<std::vector<unsigned char> > PreviewTiles::tile(int level,int col,int row)
+    {
+        cv::Mat roi;
+        int version;
+        tile_id id(level,col,row);
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            if(levels_.empty() || level < 0 || level > info_.max_level || col < 0 || row < 0)
+                return nullptr;
+            auto p = cache_.find(id);
+            if(p != cache_.end())
+                return p->second;
+            cv::Mat img = level_image(level);
+            cv::Rect rect(col * tile_size,row * tile_size,tile_size,tile_size);
+            rect &= cv::Rect(0,0,img.cols,img.rows);
+            if(rect.empty())
+                return nullptr;
+            // levels are never modified, only replaced, so ROI stays valid after unlock
+            roi = img(rect);
+            version = info_.version;
+        }
+        std::shared_ptr<std::vector<unsigned char> > data(new std::vector<unsigned char>());
+        cv::imencode(".jpeg",roi,*data);
+        std::unique_lock<std::mutex> guard(lock_);
+        if(version == info_.version)
+            cache_[id] = data;
+        return data;
+    }
+}
@@ -0,0 +1,237 @@
+#include "process_runner.h"
+#include <booster/log.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+namespace ols {
+    namespace {
+        int open_pidfd(pid_t pid)
+        {
+        #ifdef SYS_pidfd_open
+            return syscall(SYS_pidfd_open,pid,0);
+        #else
+            errno = ENOSYS;
+            return -1;
+        #endif
+        }
+
+        struct Pipe {
+            int fd[2] = {-1,-1};
+            Pipe()
+            {
+                if(pipe2(fd,O_CLOEXEC) < 0)
+                    throw std::system_error(errno,std::generic_category(),"Failed to create pipe");
+            }
+            ~Pipe()
+            {
+                close_read();
+                close_write();
+            }
+            void close_read()
+            {
+                if(fd[0] >= 0)
+                    close(fd[0]);
+                fd[0] = -1;
+            }
+            void close_write()
+            {
+                if(fd[1] >= 0)
+                    close(fd[1]);
+                fd[1] = -1;
+            }
+        };
+
+        /// read available data, returns false on EOF
+        bool drain(int fd,std::string &out)
+        {
+            char buf[4096];
+            while(true) {
+                int n = read(fd,buf,sizeof(buf));
+                if(n > 0) {
+                    out.append(buf,n);
+                    // keep only the tail, it has the diagnostics
+                    if(out.size() > 2 * ProcessRunner::max_output)
+                        out.erase(0,out.size() - ProcessRunner::max_output);
+                    continue;
+                }
+                if(n == 0)
+                    return false;
+                int e = errno;
+                if(e == EINTR)
+                    continue;
+                return e == EAGAIN || e == EWOULDBLOCK;
+            }
+        }
+
+        bool wait_child(pid_t pid,int &status,int opt)
+        {
+            while(true) {
+                int r = waitpid(pid,&status,opt);
+                if(r == pid)
+                    return true;
+                if(r == 0)
+                    return false;
+                int e = errno;
+                if(e != EINTR)
+                    throw std::system_error(e,std::generic_category(),"wait failed");
+            }
+        }
+    }
+
+    ProcessRunner::ProcessRunner(std::string const &temp_root,std::string const &job_name)
+    {
+        std::string tmpl = temp_root + "/" + job_name + "_XXXXXX";
+        std::vector<char> path(tmpl.begin(),tmpl.end());
+        path.push_back(0);
+        if(!mkdtemp(path.data()))
+            throw std::system_error(errno,std::generic_category(),"Failed to create job directory in " + temp_root);
+        dir_ = path.data();
+    }
+
+    ProcessRunner::~ProcessRunner()
+    {
+        std::unique_ptr<DIR,int(*)(DIR *)> dir(opendir(dir_.c_str()),closedir);
+        if(dir) {
+            struct dirent *de;
+            while((de = readdir(dir.get())) != nullptr) {
+                if(strcmp(de->d_name,".") == 0 || strcmp(de->d_name,"..") == 0)
+                    continue;
+                unlink((dir_ + "/" + de->d_name).c_str());
+            }
+        }
+        if(rmdir(dir_.c_str()) < 0)
+            BOOSTER_WARNING("ols") << "Failed to remove job directory " << dir_ << ": " << strerror(errno);
+    }
+
+    ProcessRunner::Result ProcessRunner::run(std::vector<std::string> const &args,double timeout)
+    {
+        if(args.empty())
+            throw std::invalid_argument("No executable given");
+        std::vector<std::string> args_copy = args;
+        std::vector<char *> argv;
+        for(auto &arg : args_copy)
+            argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
+        std::string exec_error = "exec of " + args[0] + " failed: ";
+
+        Pipe out,err;
+        pid_t pid = fork();
+        if(pid == 0) {
+            int in_fd = open("/dev/null",O_RDONLY);
+            dup2(in_fd,0);
+            dup2(out.fd[1],1);
+            dup2(err.fd[1],2);
+            if(chdir(dir_.c_str()) < 0) {
+                // absolute paths still work
+            }
+            #ifdef ANDROID_SUPPORT
+            execv(argv[0],argv.data());
+            #else
+            execvp(argv[0],argv.data());
+            #endif
+            char const *msg = strerror(errno);
+            if(write(2,exec_error.c_str(),exec_error.size()) < 0 || write(2,msg,strlen(msg)) < 0) {
+                // nothing to do
+            }
+            _exit(127);
+        }
+        else if(pid < 0) {
+            throw std::system_error(errno,std::generic_category(),"Failed to create process");
+        }
+        out.close_write();
+        err.close_write();
+        fcntl(out.fd[0],F_SETFL,fcntl(out.fd[0],F_GETFL) | O_NONBLOCK);
+        fcntl(err.fd[0],F_SETFL,fcntl(err.fd[0],F_GETFL) | O_NONBLOCK);
+        int pidfd = open_pidfd(pid);
+
+        Result res;
+        int status = 0;
+        bool exited = false;
+        bool out_open = true, err_open = true;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(int(timeout * 1000));
+        try {
+            while(!exited) {
+                int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+                if(remaining <= 0) {
+                    res.timed_out = true;
+                    kill(pid,SIGKILL);
+                    wait_child(pid,status,0);
+                    exited = true;
+                    break;
+                }
+                struct pollfd pfd[3];
+                int fds[3];
+                int n = 0;
+                if(out_open)
+                    fds[n++] = out.fd[0];
+                if(err_open)
+                    fds[n++] = err.fd[0];
+                if(pidfd >= 0)
+                    fds[n++] = pidfd;
+                for(int i=0;i<n;i++) {
+                    pfd[i].fd = fds[i];
+                    pfd[i].events = POLLIN;
+                    pfd[i].revents = 0;
+                }
+                // without pidfd (old kernels) the exit is checked periodically
+                int wait_ms = pidfd >= 0 ? remaining : std::min(remaining,50);
+                int r = poll(pfd,n,wait_ms);
+                if(r < 0) {
+                    int e = errno;
+                    if(e == EINTR)
+                        continue;
+                    throw std::system_error(e,std::generic_category(),"poll failed");
+                }
+                for(int i=0;i<n;i++) {
+                    if(pfd[i].revents == 0)
+                        continue;
+                    if(pfd[i].fd == out.fd[0])
+                        out_open = drain(out.fd[0],res.out);
+                    else if(pfd[i].fd == err.fd[0])
+                        err_open = drain(err.fd[0],res.err);
+                    else
+                        exited = wait_child(pid,status,0);
+                }
+                if(pidfd < 0 && !exited)
+                    exited = wait_child(pid,status,WNOHANG);
+            }
+        }
+        catch(...) {
+            if(!exited) {
+                kill(pid,SIGKILL);
+                waitpid(pid,&status,0);
+            }
+            if(pidfd >= 0)
+                close(pidfd);
+            throw;
+        }
+        if(pidfd >= 0)
+            close(pidfd);
+        // whatever was written before exit, descendants may still hold the pipes open
+        if(out_open)
+            drain(out.fd[0],res.out);
+        if(err_open)
+            drain(err.fd[0],res.err);
+        for(std::string *s : {&res.out,&res.err}) {
+            if(s->size() > max_output)
+                s->erase(0,s->size() - max_output);
+        }
+        res.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        return res;
+    }
+}
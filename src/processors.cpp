@@ -2,6 +2,8 @@
 #include "rotation.h"
 #include "stacker.h"
 #include "tiffmat.h"
+#include "ser_file.h"
+#include "preview_tiles.h"
 #include "common_utils.h"
 #include <booster/log.h>
 #include "processors.h"
@@ -31,6 +33,43 @@ namespace ols {
         send_message(q,id,e.what());
     }
 
+    static void save_stretch(std::string const &data_dir,StretchInfo const &stretch)
+    {
+        cppcms::json::value s;
+        s["gain"]   = stretch.gain;
+        s["cut"]    = stretch.cut;
+        s["gamma" ] = stretch.gamma;
+        s["auto_stretch"] = stretch.auto_stretch;
+        std::string fname = data_dir + "/stretch.json";
+        std::ofstream f(fname);
+        if(!f) {
+            BOOSTER_ERROR("stacker") << " Failed to save info to " << fname;
+            return;
+        }
+        s.save(f,cppcms::json::readable);
+        f.close();
+    }
+
+    static cv::Mat to16bit(cv::Mat m)
+    {
+        cv::Mat m2 = cv::max(0,m);
+        double max_v;
+        cv::minMaxLoc(m2,nullptr,&max_v);
+        cv::Mat res;
+        m2.convertTo(res,CV_MAKETYPE(CV_16U,m.channels()),65535/max_v);
+        return res;
+    }
+
+    static std::shared_ptr<CameraFrame> make_plate_solving_frame(cv::Mat img8)
+    {
+        std::shared_ptr<CameraFrame> frame(new CameraFrame());
+        frame->format.width = img8.cols;
+        frame->format.height = img8.rows;
+        frame->frame = img8;
+        frame->frame_dr = 255;
+        return frame;
+    }
+
     class PreProcessor {
     public:
         constexpr static int gamma_table_size = 128;
@@ -319,13 +358,149 @@ namespace ols {
         return std::thread([=]() { p->run(); });
     }
     
+    /// accumulates average and maximal latency in seconds
+    struct LatencyStats {
+        double sum = 0;
+        double max = 0;
+        int count = 0;
+        void add(double v)
+        {
+            sum += v;
+            max = std::max(max,v);
+            count++;
+        }
+        double mean_ms() const
+        {
+            return count > 0 ? sum / count * 1e3 : -1;
+        }
+        double max_ms() const
+        {
+            return count > 0 ? max * 1e3 : -1;
+        }
+    };
+
+    ///
+    /// Additional product of the session: own Stacker fed with frames registered by the main
+    /// stacker, runs on its own thread so the main pipeline pays only for the hand over
+    ///
+    class StackerOutput {
+    public:
+        StackerOutput(StackerControl const &ctl,StackerOutputConfig const &cfg) :
+            cfg_(cfg),
+            output_path_(ctl.output_path + "_" + cfg.suffix),
+            queue_(new queue_type(4))
+        {
+            if(ctl.mono)
+                cfg_.channel = -1;
+            channels_ = (ctl.mono || cfg_.channel >= 0) ? 1 : 3;
+            stacker_.reset(new Stacker(ctl.width,ctl.height,channels_));
+            stacker_->set_stretch(ctl.auto_stretch,ctl.stretch_low,ctl.stretch_high,ctl.stretch_gamma);
+            stacker_->set_remove_satellites(cfg_.remove_satellites);
+            if(cfg_.drizzle_scale > 1)
+                stacker_->set_drizzle(cfg_.drizzle_scale,cfg_.drizzle_pixfrac);
+            stacker_->set_rollback_on_pause(ctl.rollback_on_pause,ctl.rollback_frames);
+            stacker_->set_canvas(ctl.canvas);
+            stacker_->set_frame_weighting(cfg_.frame_weighting);
+            stacker_->set_background_extraction(ctl.background_extraction);
+            stacker_->set_wb_stars(ctl.wb_stars);
+            thread_ = std::thread([this]() { run(); });
+        }
+        ~StackerOutput()
+        {
+            queue_->push(std::shared_ptr<ShutDownData>(new ShutDownData()));
+            thread_.join();
+        }
+
+        /// frame stacked by the main stacker, must not be modified afterwards
+        void push(cv::Mat frame,cv::Point2f shift)
+        {
+            std::shared_ptr<RegisteredFrame> data(new RegisteredFrame());
+            data->frame = frame;
+            data->shift = shift;
+            queue_->push(data);
+        }
+        void push(std::shared_ptr<StackerControl> ctl)
+        {
+            queue_->push(ctl);
+        }
+    private:
+        struct RegisteredFrame : public QueueData {
+            cv::Mat frame;
+            cv::Point2f shift;
+        };
+
+        void run()
+        {
+            while(true) {
+                auto data_ptr = queue_->pop();
+                if(std::dynamic_pointer_cast<ShutDownData>(data_ptr))
+                    break;
+                try {
+                    auto frame = std::dynamic_pointer_cast<RegisteredFrame>(data_ptr);
+                    if(frame) {
+                        cv::Mat img = frame->frame;
+                        if(cfg_.channel >= 0)
+                            cv::extractChannel(frame->frame,img,cfg_.channel);
+                        stacker_->stack_registered(img,frame->shift);
+                        continue;
+                    }
+                    auto ctl = std::dynamic_pointer_cast<StackerControl>(data_ptr);
+                    if(ctl)
+                        handle_config(*ctl);
+                }
+                catch(std::exception const &e) {
+                    BOOSTER_ERROR("stacker") << "Stacking of output " << cfg_.suffix << " failed:" << e.what();
+                }
+            }
+        }
+
+        void handle_config(StackerControl const &ctl)
+        {
+            switch(ctl.op) {
+            case StackerControl::ctl_pause:
+                stacker_->handle_pause();
+                break;
+            case StackerControl::ctl_update:
+                stacker_->set_stretch(ctl.auto_stretch,ctl.stretch_low,ctl.stretch_high,ctl.stretch_gamma);
+                break;
+            case StackerControl::ctl_save:
+                save();
+                break;
+            default:
+                ;
+            }
+        }
+
+        void save()
+        {
+            if(stacker_->stacked_count() == 0)
+                return;
+            version_++;
+            std::string base_name = output_path_ + "_stacked_v" + std::to_string(version_);
+            save_tiff(to16bit(stacker_->get_raw_stacked_image()),base_name + ".tiff");
+            cv::Mat img8;
+            stacker_->get_stacked_image().first.convertTo(img8,CV_MAKETYPE(CV_8U,channels_),255);
+            cv::imwrite(base_name + ".jpeg",img8);
+            BOOSTER_INFO("stacker") << "Saved output " << cfg_.suffix << " of " << stacker_->stacked_count() << " frames to " << base_name;
+        }
+
+        StackerOutputConfig cfg_;
+        int channels_;
+        std::string output_path_;
+        int version_ = 0;
+        std::unique_ptr<Stacker> stacker_;
+        queue_pointer_type queue_;
+        std::thread thread_;
+    };
+
     class StackerProcessor {
     public:
-        StackerProcessor(queue_pointer_type in,queue_pointer_type out,queue_pointer_type stats,queue_pointer_type plate_solving,std::string data_dir) :
+        StackerProcessor(queue_pointer_type in,queue_pointer_type out,queue_pointer_type stats,queue_pointer_type plate_solving,std::string data_dir,queue_pointer_type preview) :
             in_(in),
             out_(out),
             stats_(stats),
             plate_solving_(plate_solving),
+            preview_(preview),
             data_dir_(data_dir)
         {
         }
@@ -335,8 +510,12 @@ namespace ols {
                 auto data_ptr = in_->pop();
                 auto stop_ptr = std::dynamic_pointer_cast<ShutDownData>(data_ptr);
                 if(stop_ptr) {
+                    // complete pending saves of additional outputs
+                    outputs_.clear();
                     if(out_)
                         out_->push(data_ptr);
+                    if(preview_)
+                        preview_->push(data_ptr);
                     break;
                 }
                 auto video_ptr = std::dynamic_pointer_cast<CameraFrame>(data_ptr);
@@ -368,23 +547,6 @@ namespace ols {
             }
         }
 
-        void save_stretch(StretchInfo const &stretch)
-        {
-            cppcms::json::value s;
-            s["gain"]   = stretch.gain;
-            s["cut"]    = stretch.cut;
-            s["gamma" ] = stretch.gamma;
-            s["auto_stretch"] = stretch.auto_stretch;
-            std::string fname = data_dir_ + "/stretch.json";
-            std::ofstream f(fname);
-            if(!f) {
-                BOOSTER_ERROR("stacker") << " Failed to save info to " << fname;
-                return;
-            }
-            s.save(f,cppcms::json::readable);
-            f.close();
-        }
-        
         std::shared_ptr<CameraFrame> generate_dummy_frame()
         {
             return ols::generate_dummy_frame(width_,height_,channels_);
@@ -393,7 +555,7 @@ namespace ols {
         std::pair<std::shared_ptr<CameraFrame>,std::shared_ptr<CameraFrame> > generate_output_frame(std::pair<cv::Mat,StretchInfo> data,bool create_ps_frame=true)
         {
             cv::Mat img = data.first;
-            save_stretch(data.second);
+            save_stretch(data_dir_,data.second);
             cv::Mat img8;
             img.convertTo(img8,CV_8UC3,255);
             std::shared_ptr<CameraFrame> frame(new CameraFrame());
@@ -403,20 +565,30 @@ namespace ols {
             std::vector<unsigned char> buf;
             cv::imencode(".jpeg",img8,buf);
             frame->jpeg_frame = std::shared_ptr<VideoFrame>(new VideoFrame(buf.data(),buf.size()));
-            if(plate_solving_ && create_ps_frame) {
-                plate_solving_frame.reset(new CameraFrame());
-                plate_solving_frame->format.width = img8.cols;
-                plate_solving_frame->format.height = img8.rows;
-                plate_solving_frame->frame = img8;
-                plate_solving_frame->frame_dr = 255;
-            }
+            if(plate_solving_ && create_ps_frame)
+                plate_solving_frame = make_plate_solving_frame(img8);
             return std::make_pair(frame,plate_solving_frame);
         }
 
+        /// pass cached preview image to the renderer, stretch and jpeg are done there
+        void send_preview_image()
+        {
+            std::shared_ptr<StackedPreviewData> data(new StackedPreviewData());
+            auto img = stacker_->get_preview_image();
+            data->image = img.first;
+            data->histogramm = std::move(img.second);
+            data->background = stacker_->background_model();
+            data->plate_solving = true;
+            preview_->push(data);
+        }
+
         void send_updated_image()
         {
             if(out_) {
-                if(stacker_->stacked_count() > 0) {
+                if(stacker_->stacked_count() > 0 && preview_) {
+                    send_preview_image();
+                }
+                else if(stacker_->stacked_count() > 0) {
                     auto frames = generate_output_frame(stacker_->get_stacked_image());
                     out_->push(frames.first);
                     if(plate_solving_)
@@ -427,16 +599,6 @@ namespace ols {
             }
         }
 
-        cv::Mat to16bit(cv::Mat m)
-        {
-            cv::Mat m2 = cv::max(0,m);
-            double max_v;
-            cv::minMaxLoc(m2,nullptr,&max_v);
-            cv::Mat res;
-            m2.convertTo(res,channels_ == 3 ? CV_16UC3 : CV_16UC1,65535/max_v);
-            return res;
-        }
-
 
         void create_meta(std::ostream &m)
         {
@@ -509,16 +671,47 @@ namespace ols {
                     stats->histogramm = std::move(stacker_->get_histogramm());
             }
             stats->dropped = dropped_count_;
+            stats->sdk_dropped = sdk_dropped_count_;
+            stats->gaps = gaps_count_;
+            stats->skipped = skipped_count_;
+            stats->capture_latency_ms = capture_latency_.mean_ms();
+            stats->queue_latency_ms = queue_latency_.mean_ms();
+            stats->queue_latency_max_ms = queue_latency_.max_ms();
+            stats->stacked_latency_ms = stacked_latency_.mean_ms();
             return stats;
         }
 
+        void update_latency(std::shared_ptr<CameraFrame> const &video)
+        {
+            if(video->enqueue_ts <= 0)
+                return;
+            double now = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::system_clock::now().time_since_epoch()).count();
+            double queued = now - video->enqueue_ts;
+            queue_latency_.add(queued);
+            if(video->capture_latency >= 0) {
+                capture_latency_.add(video->capture_latency);
+                stacked_latency_.add(video->capture_latency + queued);
+            }
+        }
+
         std::pair<std::shared_ptr<CameraFrame>,std::shared_ptr<CameraFrame> > handle_video(std::shared_ptr<CameraFrame> video)
         {
             std::shared_ptr<CameraFrame> res;
             std::shared_ptr<CameraFrame> ps;
+            if(video->reference) {
+                if(stacker_)
+                    stacker_->set_reference(video->processed_frame);
+                return std::make_pair(res,ps);
+            }
 		    auto start = std::chrono::high_resolution_clock::now();
             try {
                 dropped_count_ += video->dropped;
+                sdk_dropped_count_ += video->sdk_dropped;
+                gaps_count_ += video->gaps;
+                skipped_count_ += video->skipped;
+                if(received_count_++ == 0)
+                    session_start_ = start;
+                session_end_ = start;
                 if(calibration_) {
                     cframe_ +=  video->processed_frame;
                     cframe_count_ ++;
@@ -530,10 +723,19 @@ namespace ols {
                 else {
                     if(stacker_->stack_image(video->processed_frame,restart_)) {
                         restart_ = false;
+                        // only frames that made it to the stack, failed and waiting ones would skew it
+                        update_latency(video);
+                        for(auto &output : outputs_)
+                            output->push(stacker_->last_registered_frame(),stacker_->last_registered_shift());
 		                auto p1 = std::chrono::high_resolution_clock::now();
                         double time = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(p1-start).count();
                         double gtime = 0,jtime = 0;
-                        if(out_) {
+                        if(out_ && preview_) {
+                            send_preview_image();
+                            auto p2 = std::chrono::high_resolution_clock::now();
+                            gtime = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(p2-p1).count();
+                        }
+                        else if(out_) {
                             auto img = stacker_->get_stacked_image();
                             auto p2 = std::chrono::high_resolution_clock::now();
                             auto frames = generate_output_frame(img);
@@ -545,6 +747,9 @@ namespace ols {
                         }
                         BOOSTER_INFO("stacker") << "Stacking took " << (1e3*time) << " ms, generation " << (1e3*gtime) << " ms, jpeg took=" << (1e3*jtime);
                     }
+                    else if(stacker_->lucky_pending() > 0) {
+                        BOOSTER_INFO("stacker") << "Frame queued for lucky selection, " << stacker_->lucky_pending() << " in window";
+                    }
                     else {
                         BOOSTER_INFO("stacker") << "Failed to stack frame";
                         auto end = std::chrono::high_resolution_clock::now();
@@ -604,10 +809,23 @@ namespace ols {
             db.save(res,cppcms::json::readable);
             res.close();
         }
+        void log_session_summary()
+        {
+            int stacked = calibration_ ? cframe_count_ : (stacker_ ? stacker_->stacked_count() : 0);
+            double passed = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(session_end_ - session_start_).count();
+            double fps = passed > 0 ? (received_count_ - 1) / passed : 0;
+            BOOSTER_INFO("stacker") << "Session summary: received " << received_count_ << " frames in " << passed << " s, "
+                << fps << " fps, stacked " << stacked << ", missed " << (received_count_ - stacked) 
+                << ", dropped before processing " << dropped_count_ << ", dropped by camera " << sdk_dropped_count_
+                << ", frame counter gaps " << gaps_count_ << ", skipped by frame rate limit " << skipped_count_;
+            BOOSTER_INFO("stacker") << "Session latency: capture to queue " << capture_latency_.mean_ms() << " ms, queue to stacked "
+                << queue_latency_.mean_ms() << " ms (max " << queue_latency_.max_ms() << " ms), capture to stacked " << stacked_latency_.mean_ms() << " ms";
+        }
         void handle_config(std::shared_ptr<StackerControl> ctl)
         {
             switch(ctl->op) {
             case StackerControl::ctl_init:
+                received_count_ = 0;
                 width_ = ctl->width;
                 height_ = ctl->height;
                 mono_ = ctl->mono;
@@ -619,7 +837,12 @@ namespace ols {
                 output_path_ = ctl->output_path;
                 name_ = ctl->name;
                 dropped_count_ = 0;
+                sdk_dropped_count_ = 0;
+                gaps_count_ = 0;
+                skipped_count_ = 0;
+                capture_latency_ = queue_latency_ = stacked_latency_ = LatencyStats();
                 stacker_.reset();
+                outputs_.clear();
                 stack_info_ = *ctl;
                 if(calibration_) {
                     cframe_ = cv::Mat(height_,width_,cv_type_);
@@ -630,9 +853,27 @@ namespace ols {
                     stacker_.reset(new Stacker(width_,height_,channels_));
                     stacker_->set_stretch(ctl->auto_stretch,ctl->stretch_low,ctl->stretch_high,ctl->stretch_gamma);
                     stacker_->set_remove_satellites(ctl->remove_satellites);
-                    stacker_->set_rollback_on_pause(ctl->rollback_on_pause);
+                    if(ctl->drizzle_scale > 1)
+                        stacker_->set_drizzle(ctl->drizzle_scale,ctl->drizzle_pixfrac);
+                    stacker_->set_rollback_on_pause(ctl->rollback_on_pause,ctl->rollback_frames);
+                    stacker_->set_canvas(ctl->canvas);
+                    stacker_->set_frame_weighting(ctl->frame_weighting);
+                    stacker_->set_background_extraction(ctl->background_extraction);
+                    stacker_->set_wb_stars(ctl->wb_stars);
+                    stacker_->set_estimate_rotation(ctl->estimate_rotation);
+                    if(ctl->lucky_window > 0)
+                        stacker_->set_lucky(ctl->lucky_window,ctl->lucky_keep_percent,ctl->lucky_compact);
+                    if(!ctl->outputs.empty() && ctl->lucky_window > 0) {
+                        BOOSTER_WARNING("stacker") << "Additional outputs are not supported with lucky imaging, ignoring";
+                    }
+                    else {
+                        for(auto const &cfg : ctl->outputs)
+                            outputs_.emplace_back(new StackerOutput(*ctl,cfg));
+                    }
                     restart_ = true;
                 }
+                if(preview_)
+                    preview_->push(ctl);
                 if(out_)
                     out_->push(generate_dummy_frame());
                 if(stats_) {
@@ -642,6 +883,8 @@ namespace ols {
                 break;
             case StackerControl::ctl_pause:
                 restart_ = true;
+                for(auto &output : outputs_)
+                    output->push(ctl);
                 if(stacker_) {
                     stacker_->handle_pause();
                     send_updated_image();
@@ -651,6 +894,10 @@ namespace ols {
                 }
                 break;
             case StackerControl::ctl_cancel:
+                log_session_summary();
+                if(preview_)
+                    preview_->push(ctl);
+                outputs_.clear();
                 if(stacker_) {
                     stacker_.reset();
                 }
@@ -659,6 +906,11 @@ namespace ols {
                 }
                 break;
             case StackerControl::ctl_save:
+                if(stacker_)
+                    stacker_->flush_lucky();
+                log_session_summary();
+                for(auto &output : outputs_)
+                    output->push(ctl);
                 if(stacker_) {
                     save_stacked_image_and_send();
                     saved_count_ = stacker_->stacked_count();
@@ -672,10 +924,14 @@ namespace ols {
                 }
                 break;
             case StackerControl::ctl_update:
+                for(auto &output : outputs_)
+                    output->push(ctl);
                 if(stacker_) {
                     stacker_->set_stretch(ctl->auto_stretch,ctl->stretch_low,ctl->stretch_high,ctl->stretch_gamma);
                     BOOSTER_INFO("stacker") << "Getting to stretch settings in stacker auto="<<ctl->auto_stretch << " low="<<ctl->stretch_low << " high=" << ctl->stretch_high << " gamma=" << ctl->stretch_gamma;
-                    send_updated_image();
+                    // with the preview renderer stretch updates are delivered to it directly
+                    if(!preview_)
+                        send_updated_image();
                 }
                 break;
             default:
@@ -684,7 +940,7 @@ namespace ols {
             }
         }
     private:
-        queue_pointer_type in_,out_,stats_,plate_solving_;
+        queue_pointer_type in_,out_,stats_,plate_solving_,preview_;
         std::string data_dir_;
         int width_,height_;
         bool mono_;
@@ -695,15 +951,178 @@ namespace ols {
         cv::Mat cframe_;
         int cframe_count_;
         int dropped_count_ = 0;
+        int sdk_dropped_count_ = 0;
+        int gaps_count_ = 0;
+        int skipped_count_ = 0;
+        LatencyStats capture_latency_,queue_latency_,stacked_latency_;
+        int received_count_ = 0;
+        std::chrono::high_resolution_clock::time_point session_start_,session_end_;
         std::unique_ptr<Stacker> stacker_;
+        std::vector<std::unique_ptr<StackerOutput> > outputs_;
         bool restart_;
         int saved_count_ = 0;
         StackerControl stack_info_;
     };
 
-    std::thread start_stacker(queue_pointer_type in,queue_pointer_type out,queue_pointer_type stats,queue_pointer_type plate_solving,std::string data_dir)
+    std::thread start_stacker(queue_pointer_type in,queue_pointer_type out,queue_pointer_type stats,queue_pointer_type plate_solving,std::string data_dir,queue_pointer_type preview)
     {
-        std::shared_ptr<StackerProcessor> p(new StackerProcessor(in,out,stats,plate_solving,data_dir));
+        std::shared_ptr<StackerProcessor> p(new StackerProcessor(in,out,stats,plate_solving,data_dir,preview));
+        return std::thread([=]() { p->run(); });
+    }
+
+    ///
+    /// Renders stacked image for display from 16 bit white balanced cache using 65536 entries
+    /// lookup table, so stretch changes are applied in milliseconds without touching the stacker
+    ///
+    class PreviewRenderer {
+    public:
+        PreviewRenderer(queue_pointer_type in,queue_pointer_type out,queue_pointer_type plate_solving,std::string data_dir,std::shared_ptr<PreviewTiles> tiles) :
+            in_(in),
+            out_(out),
+            plate_solving_(plate_solving),
+            data_dir_(data_dir),
+            tiles_(tiles),
+            lut_(65536)
+        {
+        }
+        void run()
+        {
+            bool stop = false;
+            while(!stop) {
+                auto data_ptr = in_->pop();
+                bool changed = false;
+                // only the latest image and stretch matter, skip intermediate updates
+                do {
+                    if(std::dynamic_pointer_cast<ShutDownData>(data_ptr)) {
+                        stop = true;
+                        break;
+                    }
+                    changed = handle(data_ptr) || changed;
+                } while(in_->try_pop(data_ptr));
+                if(stop || !changed || image_.empty())
+                    continue;
+                try {
+                    render();
+                }
+                catch(std::exception const &e) {
+                    BOOSTER_ERROR("stacker") << "Preview rendering failed:" << e.what();
+                }
+            }
+        }
+    private:
+        bool handle(data_pointer_type data_ptr)
+        {
+            auto img = std::dynamic_pointer_cast<StackedPreviewData>(data_ptr);
+            if(img) {
+                image_ = img->image;
+                histogramm_ = std::move(img->histogramm);
+                background_ = img->background;
+                send_plate_solving_ = send_plate_solving_ || img->plate_solving;
+                return true;
+            }
+            auto ctl = std::dynamic_pointer_cast<StackerControl>(data_ptr);
+            if(!ctl)
+                return false;
+            switch(ctl->op) {
+            case StackerControl::ctl_init:
+                image_.release();
+                send_plate_solving_ = false;
+                if(tiles_)
+                    tiles_->clear();
+                stretch_.set(ctl->auto_stretch,ctl->stretch_low,ctl->stretch_high,ctl->stretch_gamma);
+                return false;
+            case StackerControl::ctl_cancel:
+                image_.release();
+                send_plate_solving_ = false;
+                if(tiles_)
+                    tiles_->clear();
+                return false;
+            case StackerControl::ctl_update:
+                stretch_.set(ctl->auto_stretch,ctl->stretch_low,ctl->stretch_high,ctl->stretch_gamma);
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        void update_lut(StretchInfo const &s)
+        {
+            if(lut_valid_ && s.gain == lut_stretch_.gain && s.cut == lut_stretch_.cut && s.gamma == lut_stretch_.gamma)
+                return;
+            float invg = 1.0f / s.gamma;
+            for(int i=0;i<65536;i++) {
+                float v = i * (1.0f / 65535);
+                v = std::max(0.0f,std::min(1.0f,float(v * s.gain - s.cut)));
+                if(s.gamma != 1.0)
+                    v = std::pow(v,invg);
+                lut_[i] = cv::saturate_cast<unsigned char>(v * 255.0f);
+            }
+            lut_stretch_ = s;
+            lut_valid_ = true;
+        }
+
+        void render()
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            StretchInfo stretch = calc_stretch(histogramm_.data(),histogramm_.size(),stretch_);
+            update_lut(stretch);
+            cv::Mat img8(image_.rows,image_.cols,CV_MAKETYPE(CV_8U,image_.channels()));
+            int N = image_.cols * image_.channels();
+            unsigned char const *lut = lut_.data();
+            bool subtract = !background_.empty() && background_.width == image_.cols && background_.height == image_.rows;
+            cv::parallel_for_(cv::Range(0,image_.rows),[&](cv::Range const &range) {
+                std::vector<float> bg(subtract ? N : 0);
+                for(int r=range.start;r<range.end;r++) {
+                    uint16_t const *src = image_.ptr<uint16_t>(r);
+                    unsigned char *dst = img8.ptr<unsigned char>(r);
+                    if(subtract) {
+                        background_.row(r,bg.data());
+                        for(int i=0;i<N;i++) {
+                            int v = src[i] - int(bg[i] * 65535.0f);
+                            dst[i] = lut[std::max(0,std::min(65535,v))];
+                        }
+                    }
+                    else {
+                        for(int i=0;i<N;i++)
+                            dst[i] = lut[src[i]];
+                    }
+                }
+            });
+            auto stretched = std::chrono::high_resolution_clock::now();
+            if(tiles_)
+                tiles_->update(img8);
+            std::shared_ptr<CameraFrame> frame(new CameraFrame());
+            frame->format.width = img8.cols;
+            frame->format.height = img8.rows;
+            std::vector<unsigned char> buf;
+            cv::imencode(".jpeg",img8,buf);
+            frame->jpeg_frame = std::shared_ptr<VideoFrame>(new VideoFrame(buf.data(),buf.size()));
+            if(out_)
+                out_->push(frame);
+            if(plate_solving_ && send_plate_solving_)
+                plate_solving_->push(make_plate_solving_frame(img8));
+            send_plate_solving_ = false;
+            save_stretch(data_dir_,stretch);
+            auto end = std::chrono::high_resolution_clock::now();
+            BOOSTER_INFO("stacker") << "Preview stretch took " << Stacker::tdiff(start,stretched) << "ms, jpeg " << Stacker::tdiff(stretched,end) << "ms";
+        }
+
+        queue_pointer_type in_,out_,plate_solving_;
+        std::string data_dir_;
+        std::shared_ptr<PreviewTiles> tiles_;
+        cv::Mat image_;
+        std::vector<int> histogramm_;
+        BackgroundModel background_;
+        bool send_plate_solving_ = false;
+        StretchSettings stretch_;
+        std::vector<unsigned char> lut_;
+        StretchInfo lut_stretch_;
+        bool lut_valid_ = false;
+    };
+
+    std::thread start_preview_renderer(queue_pointer_type in,queue_pointer_type out,queue_pointer_type plate_solving,std::string data_dir,std::shared_ptr<PreviewTiles> tiles)
+    {
+        std::shared_ptr<PreviewRenderer> p(new PreviewRenderer(in,out,plate_solving,data_dir,tiles));
         return std::thread([=]() { p->run(); });
     }
 
@@ -723,6 +1142,7 @@ namespace ols {
                 auto data_ptr = in_->pop();
                 auto stop_ptr = std::dynamic_pointer_cast<ShutDownData>(data_ptr);
                 if(stop_ptr) {
+                    close_session();
                     break;
                 }
                 auto video_ptr = std::dynamic_pointer_cast<CameraFrame>(data_ptr);
@@ -751,12 +1171,45 @@ namespace ols {
         {
             return dirname_ + "/log.txt";
         }
+        std::string ser_file()
+        {
+            return dirname_ + "/frames.ser";
+        }
+        void close_session()
+        {
+            try {
+                if(ser_) {
+                    BOOSTER_INFO("stacker") << "Closing " << ser_file() << " with " << ser_->frames() << " frames";
+                    ser_->close();
+                }
+            }
+            catch(std::exception const &e) {
+                BOOSTER_ERROR("stacker") << "Failed to close SER file: " << e.what();
+                send_message(err_,"save ser",e.what());
+            }
+            ser_.reset();
+            if(log_.is_open())
+                log_.close();
+        }
+        void save_ser(std::shared_ptr<CameraFrame> video)
+        {
+            cv::Mat img = video->raw;
+            if(!ser_) {
+                CamBayerType bayer = img.channels() == 1 ? video->bayer : bayer_na;
+                ser_.reset(new SERWriter(ser_file(),img.cols,img.rows,img.channels(),img.elemSize1(),bayer));
+                ser_->set_sync_interval(sync_interval);
+            }
+            ser_->write(img,video->timestamp);
+        }
         void handle_video(std::shared_ptr<CameraFrame> video)
         {
             char fname[256];
             snprintf(fname,sizeof(fname),"frame_%08d",counter_);
             std::string base_name = dirname_ + "/" + fname;
-            if(video->format.format == stream_mjpeg) {
+            if(ser_format_) {
+                save_ser(video);
+            }
+            else if(video->format.format == stream_mjpeg) {
                 std::ofstream f(base_name + ".jpeg",std::ofstream::binary);
                 f.write((char*)video->source_frame->data(),video->source_frame->size());
                 if(!f) {
@@ -774,9 +1227,10 @@ namespace ols {
                     BOOSTER_ERROR("stacker") << "Failed to save tiff to " << base_name << ".tiff: " << e.what();
                 }
             }
-            std::ofstream log(log_file(),std::ofstream::app);
-            log << counter_ <<"," << std::fixed << std::setprecision(3) << video->timestamp << std::endl;
+            log_ << counter_ <<"," << std::fixed << std::setprecision(3) << video->timestamp << "\n";
             counter_++;
+            if(counter_ % sync_interval == 0)
+                log_.flush();
             if(counter_ == 1) {
                 cppcms::json::value v;
                 std::ifstream info_r(dirname_ + "/info.json");
@@ -804,12 +1258,17 @@ namespace ols {
             switch(ctl->op) {
             case StackerControl::ctl_init:
                 {
+                    close_session();
                     save_ = ctl->save_inputs;
                     if(!save_)
                         return;
                     dirname_ = out_ + "/" + ctl->name;
                     counter_ = 0;
+                    ser_format_ = ctl->save_format == "ser";
                     make_dir(dirname_);
+                    log_.open(log_file(),std::ofstream::app);
+                    if(!log_)
+                        throw std::runtime_error("Failed to open " + log_file());
                     cppcms::json::value v;
                     v["name"]=ctl->name;
                     v["width"] = ctl->width;
@@ -831,6 +1290,28 @@ namespace ols {
                     v["stretch_high"] = ctl->stretch_high;
                     v["stretch_gamma"] = ctl->stretch_gamma;
                     v["remove_satellites" ] = ctl->remove_satellites;
+                    v["save_format"] = ctl->save_format;
+                    v["drizzle_scale"] = ctl->drizzle_scale;
+                    v["drizzle_pixfrac"] = ctl->drizzle_pixfrac;
+                    v["lucky_window"] = ctl->lucky_window;
+                    v["lucky_keep_percent"] = ctl->lucky_keep_percent;
+                    v["lucky_compact"] = ctl->lucky_compact;
+                    v["rollback_on_pause"] = ctl->rollback_on_pause;
+                    v["rollback_frames"] = ctl->rollback_frames;
+                    v["canvas"] = ctl->canvas;
+                    v["frame_weighting"] = ctl->frame_weighting;
+                    v["background_extraction"] = ctl->background_extraction;
+                    v["wb_stars"] = ctl->wb_stars;
+                    v["estimate_rotation"] = ctl->estimate_rotation;
+                    for(size_t i=0;i<ctl->outputs.size();i++) {
+                        auto const &o = ctl->outputs[i];
+                        v["outputs"][i]["suffix"] = o.suffix;
+                        v["outputs"][i]["channel"] = o.channel;
+                        v["outputs"][i]["remove_satellites"] = o.remove_satellites;
+                        v["outputs"][i]["frame_weighting"] = o.frame_weighting;
+                        v["outputs"][i]["drizzle"]["scale"] = o.drizzle_scale;
+                        v["outputs"][i]["drizzle"]["pixfrac"] = o.drizzle_pixfrac;
+                    }
                     std::ofstream info(dirname_ + "/info.json");
                     v.save(info,cppcms::json::readable);
                 }
@@ -856,10 +1337,15 @@ namespace ols {
                 {
                     if(!save_)
                         return;
-                    std::ofstream log(log_file(),std::ofstream::app);
-                    log << "PAUSE,0" << std::endl;
+                    log_ << "PAUSE,0" << std::endl;
+                    if(ser_)
+                        ser_->sync();
                 }
                 break;
+            case StackerControl::ctl_cancel:
+                close_session();
+                save_ = false;
+                break;
 
             default:
                 /// not much to do
@@ -867,12 +1353,16 @@ namespace ols {
             }
         }
     private:
+        static constexpr int sync_interval = 100;
 
         queue_pointer_type in_,err_;
         std::string out_;
         std::string dirname_;
         int counter_;
         bool save_;
+        bool ser_format_ = false;
+        std::ofstream log_;
+        std::unique_ptr<SERWriter> ser_;
     };
 
     std::thread start_debug_saver(queue_pointer_type in,queue_pointer_type err,std::string debug_dir)
@@ -0,0 +1,334 @@
+#include "ser_file.h"
+#include <system_error>
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <opencv2/imgproc.hpp>
+#include <errno.h>
+#include <booster/log.h>
+
+namespace ols {
+
+    // 100ns ticks between 0001-01-01 and 1970-01-01
+    static constexpr int64_t ser_unix_epoch = 621355968000000000ll;
+
+    int64_t ser_timestamp_from_unix(double unix_ts)
+    {
+        return ser_unix_epoch + int64_t(unix_ts * 1e7);
+    }
+    double ser_timestamp_to_unix(int64_t ser_ts)
+    {
+        return (ser_ts - ser_unix_epoch) * 1e-7;
+    }
+
+    SERWriter::SERWriter(std::string const &path,int width,int height,int channels,int bytes_per_channel,CamBayerType bayer) :
+        path_(path),
+        width_(width),
+        height_(height)
+    {
+        if(channels != 1 && channels != 3)
+            throw std::runtime_error("SER supports mono or 3 channel images only");
+        if(bytes_per_channel != 1 && bytes_per_channel != 2)
+            throw std::runtime_error("SER supports 8 or 16 bit images only");
+        cv_type_ = CV_MAKETYPE(bytes_per_channel == 1 ? CV_8U : CV_16U,channels);
+        frame_size_ = size_t(width) * height * channels * bytes_per_channel;
+
+        memset(&header_,0,sizeof(header_));
+        memcpy(header_.file_id,"LUCAM-RECORDER",14);
+        if(channels == 3) {
+            header_.color_id = ser_bgr; // OpenCV order
+        }
+        else {
+            switch(bayer) {
+            case bayer_rg: header_.color_id = ser_bayer_rggb; break;
+            case bayer_gr: header_.color_id = ser_bayer_grbg; break;
+            case bayer_gb: header_.color_id = ser_bayer_gbrg; break;
+            case bayer_bg: header_.color_id = ser_bayer_bggr; break;
+            default:
+                header_.color_id = ser_mono;
+            }
+        }
+        // The specification defines 1 as little endian but virtually all capture
+        // and processing software uses 0 for little endian 16 bit data, follow practice
+        header_.little_endian = 0;
+        header_.width = width;
+        header_.height = height;
+        header_.pixel_depth = bytes_per_channel * 8;
+        strncpy(header_.instrument,"OpenLiveStacker",sizeof(header_.instrument));
+        time_t now = time(nullptr);
+        struct tm local;
+        localtime_r(&now,&local);
+        header_.date_time_utc = ser_timestamp_from_unix(now);
+        header_.date_time = ser_timestamp_from_unix(now + local.tm_gmtoff);
+
+        if(posix_memalign(reinterpret_cast<void **>(&buffer_),4096,chunk_size)!=0)
+            throw std::bad_alloc();
+        fd_ = open(path_.c_str(),O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0666);
+        if(fd_ < 0) {
+            int err = errno;
+            free(buffer_);
+            throw std::system_error(err,std::generic_category(),"Failed to create " + path_);
+        }
+        append(&header_,sizeof(header_));
+    }
+
+    SERWriter::~SERWriter()
+    {
+        try {
+            close();
+        }
+        catch(std::exception const &e) {
+            BOOSTER_ERROR("stacker") << "Failed to close SER file " << path_ << ": " << e.what();
+        }
+        free(buffer_);
+    }
+
+    void SERWriter::preallocate(size_t upto)
+    {
+        if(!can_preallocate_ || upto <= allocated_)
+            return;
+        size_t new_size = (upto + prealloc_step - 1) / prealloc_step * prealloc_step;
+        int r = posix_fallocate(fd_,allocated_,new_size - allocated_);
+        if(r != 0) {
+            // not supported by file system or no space, actual write will report the error
+            BOOSTER_WARNING("stacker") << "Failed to preallocate space for " << path_ << ": " << strerror(r);
+            can_preallocate_ = false;
+            return;
+        }
+        allocated_ = new_size;
+    }
+
+    void SERWriter::flush_buffer()
+    {
+        size_t size = buffer_pos_;
+        preallocate(file_pos_ + size);
+        size_t done = 0;
+        while(done < size) {
+            ssize_t n = pwrite(fd_,buffer_ + done,size - done,file_pos_ + done);
+            if(n < 0) {
+                if(errno == EINTR)
+                    continue;
+                throw std::system_error(errno,std::generic_category(),"Failed to write to " + path_);
+            }
+            done += n;
+        }
+        file_pos_ += size;
+        buffer_pos_ = 0;
+    }
+
+    void SERWriter::append(void const *data,size_t size)
+    {
+        char const *p = static_cast<char const *>(data);
+        while(size > 0) {
+            size_t n = std::min(size,chunk_size - buffer_pos_);
+            memcpy(buffer_ + buffer_pos_,p,n);
+            buffer_pos_ += n;
+            p += n;
+            size -= n;
+            if(buffer_pos_ == chunk_size)
+                flush_buffer();
+        }
+    }
+
+    void SERWriter::write(cv::Mat const &frame,double unix_timestamp)
+    {
+        if(fd_ < 0)
+            throw std::runtime_error("SER file " + path_ + " is closed");
+        if(frame.rows != height_ || frame.cols != width_ || frame.type() != cv_type_)
+            throw std::runtime_error("Frame format does not match SER file " + path_);
+        size_t row_size = frame.cols * frame.elemSize();
+        if(frame.isContinuous()) {
+            append(frame.data,frame_size_);
+        }
+        else {
+            for(int r=0;r<frame.rows;r++)
+                append(frame.ptr(r),row_size);
+        }
+        timestamps_.push_back(ser_timestamp_from_unix(unix_timestamp));
+        if(sync_interval_ > 0 && ++since_sync_ >= sync_interval_)
+            sync();
+    }
+
+    int SERWriter::frames_on_disk()
+    {
+        if(file_pos_ < sizeof(header_))
+            return 0;
+        return (file_pos_ - sizeof(header_)) / frame_size_;
+    }
+
+    void SERWriter::update_header(int frames)
+    {
+        header_.frame_count = frames;
+        if(pwrite(fd_,&header_,sizeof(header_),0) != sizeof(header_))
+            throw std::system_error(errno,std::generic_category(),"Failed to update header of " + path_);
+    }
+
+    void SERWriter::sync()
+    {
+        if(fd_ < 0)
+            return;
+        since_sync_ = 0;
+        // keep all writes chunk aligned, only full chunks go to disk
+        if(file_pos_ == 0)
+            return;
+        update_header(frames_on_disk());
+        fdatasync(fd_);
+    }
+
+    void SERWriter::close()
+    {
+        if(fd_ < 0)
+            return;
+        int fd = fd_;
+        try {
+            for(int64_t ts : timestamps_)
+                append(&ts,sizeof(ts));
+            if(buffer_pos_ > 0)
+                flush_buffer();
+            if(ftruncate(fd_,file_pos_) < 0)
+                throw std::system_error(errno,std::generic_category(),"Failed to truncate " + path_);
+            update_header(timestamps_.size());
+            fdatasync(fd_);
+        }
+        catch(...) {
+            ::close(fd);
+            fd_ = -1;
+            throw;
+        }
+        fd_ = -1;
+        if(::close(fd) < 0)
+            throw std::system_error(errno,std::generic_category(),"Failed to close " + path_);
+    }
+
+    SERReader::SERReader(std::string const &path) :
+        path_(path)
+    {
+        int fd = open(path_.c_str(),O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            throw std::system_error(errno,std::generic_category(),"Failed to open " + path_);
+        struct stat st;
+        if(fstat(fd,&st) < 0) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err,std::generic_category(),"Failed to stat " + path_);
+        }
+        map_size_ = st.st_size;
+        if(map_size_ < sizeof(header_)) {
+            ::close(fd);
+            throw std::runtime_error("File " + path_ + " is too short for SER");
+        }
+        map_ = mmap(nullptr,map_size_,PROT_READ,MAP_SHARED,fd,0);
+        int err = errno;
+        ::close(fd);
+        if(map_ == MAP_FAILED) {
+            map_ = nullptr;
+            throw std::system_error(err,std::generic_category(),"Failed to map " + path_);
+        }
+        madvise(map_,map_size_,MADV_SEQUENTIAL);
+        memcpy(&header_,map_,sizeof(header_));
+
+        try {
+            if(memcmp(header_.file_id,"LUCAM-RECORDER",14)!=0)
+                throw std::runtime_error("File " + path_ + " is not SER file");
+            int depth;
+            if(header_.pixel_depth <= 8)
+                depth = CV_8U;
+            else if(header_.pixel_depth <= 16)
+                depth = CV_16U;
+            else
+                throw std::runtime_error("Unsupported SER pixel depth " + std::to_string(header_.pixel_depth));
+            int channels = 1;
+            switch(header_.color_id) {
+            case ser_mono: break;
+            case ser_bayer_rggb: bayer_ = bayer_rg; break;
+            case ser_bayer_grbg: bayer_ = bayer_gr; break;
+            case ser_bayer_gbrg: bayer_ = bayer_gb; break;
+            case ser_bayer_bggr: bayer_ = bayer_bg; break;
+            case ser_rgb:
+            case ser_bgr:
+                channels = 3;
+                break;
+            default:
+                throw std::runtime_error("Unsupported SER color id " + std::to_string(header_.color_id));
+            }
+            if(header_.width <= 0 || header_.height <= 0)
+                throw std::runtime_error("Invalid SER image size in " + path_);
+            cv_type_ = CV_MAKETYPE(depth,channels);
+            frame_size_ = size_t(header_.width) * header_.height * CV_ELEM_SIZE(cv_type_);
+
+            size_t available = (map_size_ - sizeof(header_)) / frame_size_;
+            if(header_.frame_count > 0 && size_t(header_.frame_count) <= available)
+                frames_ = header_.frame_count;
+            else
+                frames_ = available;
+            size_t trailer = sizeof(header_) + frame_size_ * frames_;
+            if(frames_ > 0 && map_size_ >= trailer + sizeof(int64_t) * frames_)
+                timestamps_ = reinterpret_cast<int64_t const *>(static_cast<char const *>(map_) + trailer);
+        }
+        catch(...) {
+            munmap(map_,map_size_);
+            map_ = nullptr;
+            throw;
+        }
+    }
+
+    SERReader::~SERReader()
+    {
+        if(map_)
+            munmap(map_,map_size_);
+    }
+
+    CamStreamType SERReader::stream_type() const
+    {
+        bool is16 = bytes_per_channel() == 2;
+        if(channels() == 3)
+            return is16 ? stream_rgb48 : stream_rgb24;
+        if(bayer_ != bayer_na)
+            return is16 ? stream_raw16 : stream_raw8;
+        return is16 ? stream_mono16 : stream_mono8;
+    }
+
+    double SERReader::timestamp(int index) const
+    {
+        if(!timestamps_)
+            throw std::runtime_error("No timestamps in " + path_);
+        if(index < 0 || index >= frames_)
+            throw std::out_of_range("SER frame index out of range");
+        int64_t ts;
+        memcpy(&ts,timestamps_ + index,sizeof(ts)); // trailer isn't 8 byte aligned
+        return ser_timestamp_to_unix(ts);
+    }
+
+    cv::Mat SERReader::frame(int index) const
+    {
+        if(index < 0 || index >= frames_)
+            throw std::out_of_range("SER frame index out of range");
+        char *ptr = static_cast<char *>(map_) + sizeof(header_) + frame_size_ * index;
+        cv::Mat img(header_.height,header_.width,cv_type_,ptr);
+        if(header_.color_id == ser_rgb) {
+            cv::Mat bgr;
+            cv::cvtColor(img,bgr,cv::COLOR_RGB2BGR);
+            return bgr;
+        }
+        return img;
+    }
+
+    void SERReader::prefetch(int index,int count) const
+    {
+        index = std::max(0,index);
+        count = std::min(count,frames_ - index);
+        if(count <= 0)
+            return;
+        size_t start = sizeof(header_) + frame_size_ * index;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t page_start = start / page * page;
+        size_t len = frame_size_ * count + (start - page_start);
+        madvise(static_cast<char *>(map_) + page_start,len,MADV_WILLNEED);
+    }
+}
@@ -10,7 +10,9 @@
 #include <thread>
 #include <fstream>
 #include "util.h"
+#include "sync_queue.h"
 #include "tiffmat.h"
+#include "ser_file.h"
 #include <opencv2/imgcodecs.hpp>
 #include <cppcms/json.h>
 
@@ -21,12 +23,55 @@ namespace ols {
         {
         }
     };
+    ///
+    /// Benchmark mode: all frames are loaded to memory upfront and sent in a loop
+    /// either at given rate or as fast as the pipeline accepts them
+    ///
+    struct SIMBenchmark {
+        bool enabled = false;
+        double rate = 0;        /// frames per second, 0 - unlimited
+        int backlog = 10;       /// wait while pipeline queues hold more items than that, when unlimited
+    };
+
     class SIMCamera : public Camera {
     public:
-        SIMCamera(std::string const &dir) : dir_(dir)
+        SIMCamera(std::string const &dir,SIMBenchmark const &bench = SIMBenchmark()) : 
+            dir_(dir),
+            bench_(bench)
         {
             stream_active_ = 0;
             load_frames();
+            if(bench_.enabled)
+                preload_frames();
+        }
+
+        void preload_frames()
+        {
+            size_t total = 0;
+            preloaded_.reserve(frames_.size());
+            for(FrameRef const &ref : frames_) {
+                cv::Mat img;
+                if(ser_) {
+                    img = ser_->frame(ref.index).clone();
+                }
+                else if(is_jpeg_) {
+                    std::ifstream f(ref.path,std::ifstream::binary);
+                    f.seekg(0,std::ifstream::end);
+                    size_t size = f.tellg();
+                    f.seekg(0);
+                    img = cv::Mat(1,size,CV_8UC1);
+                    f.read((char *)img.data,size);
+                    if(!f)
+                        throw SIMError("Failed to read " + ref.path);
+                }
+                else {
+                    img = load_tiff(ref.path);
+                }
+                total += img.total() * img.elemSize();
+                preloaded_.push_back(img);
+            }
+            ser_.reset();
+            fprintf(stderr,"SIM benchmark: preloaded %d frames, %5.1f MB\n",int(preloaded_.size()),total / 1024.0 / 1024.0);
         }
 
         std::string file_name(int frame_id,std::string const &ext)
@@ -53,12 +98,32 @@ namespace ols {
 
         }
 
+        void open_ser(std::string const &path)
+        {
+            ser_.reset(new SERReader(path));
+            width_ = ser_->width();
+            height_ = ser_->height();
+            bayer_ = ser_->bayer();
+            stream_ = ser_->stream_type();
+            is_jpeg_ = false;
+        }
+
         void load_frames()
         {
-            std::ifstream data(dir_  + "/log.txt");
-            if(!data)
-                throw SIMError("Failed to read log file");
             bayer_ = bayer_na;
+            std::string ser_path = dir_ + "/frames.ser";
+            if(exists(ser_path))
+                open_ser(ser_path);
+            std::ifstream data(dir_  + "/log.txt");
+            if(!data) {
+                if(!ser_ || !ser_->has_timestamps())
+                    throw SIMError("Failed to read log file");
+                for(int i=0;i<ser_->frames();i++)
+                    frames_.push_back(FrameRef{ser_->timestamp(i),std::string(),i});
+                if(frames_.empty())
+                    throw SIMError("No frames in " + ser_path);
+                return;
+            }
             std::string str;
             while(std::getline(data,str)) {
                 size_t pos = str.find(',');
@@ -68,6 +133,12 @@ namespace ols {
                 }
                 int frame_id = atoi(op.c_str());
                 double timestamp = atof(str.substr(pos+1).c_str());
+                if(ser_) {
+                    if(frame_id >= ser_->frames())
+                        break; // capture wasn't closed properly
+                    frames_.push_back(FrameRef{timestamp,std::string(),frame_id});
+                    continue;
+                }
                 if(frames_.empty()) {
                     is_jpeg_ = exists(file_name(frame_id,"jpeg"));
                 }
@@ -99,8 +170,10 @@ namespace ols {
                     else
                         throw SIMError("Unsupported image format for " + path);
                 }
-                frames_.push_back(std::make_pair(timestamp,path));
+                frames_.push_back(FrameRef{timestamp,path,frame_id});
             }
+            if(frames_.empty())
+                throw SIMError("No frames in " + dir_);
         }
 
         virtual ~SIMCamera()
@@ -138,13 +211,29 @@ namespace ols {
         void handle_frame(int index)
         {
             CamFrame frm;
-            frm.unix_timestamp = frames_.at(index).first;
+            FrameRef const &ref = frames_.at(index);
+            frm.unix_timestamp = ref.timestamp;
             frm.width = width_;
             frm.height = height_;
             std::vector<char> buf;
             cv::Mat img;
-            if(is_jpeg_) {
-                std::ifstream f(frames_.at(index).second,std::ifstream::binary);
+            if(!preloaded_.empty()) {
+                img = preloaded_.at(index);
+                frm.data = img.data;
+                frm.bayer = bayer_;
+                frm.data_size = img.total() * img.elemSize();
+                frm.unix_timestamp = timestamp();
+            }
+            else if(ser_) {
+                // zero copy, the data is mapped from file
+                img = ser_->frame(ref.index);
+                frm.data = img.data;
+                frm.bayer = bayer_;
+                frm.data_size = img.rows * img.cols * img.elemSize();
+                ser_->prefetch(current_dir_ == 1 ? ref.index + 1 : ref.index - prefetch_frames,prefetch_frames);
+            }
+            else if(is_jpeg_) {
+                std::ifstream f(ref.path,std::ifstream::binary);
                 f.seekg(0,std::ifstream::end);
                 size_t size = f.tellg();
                 buf.resize(size);
@@ -154,7 +243,7 @@ namespace ols {
                 frm.data_size = size;
             }
             else {
-                img = load_tiff(frames_.at(index).second);
+                img = load_tiff(ref.path);
                 frm.data = img.data;
                 frm.bayer = bayer_;
                 frm.data_size = img.rows * img.cols * img.elemSize();
@@ -187,6 +276,41 @@ namespace ols {
             return unix_timestamp;
         }
 
+        void run_benchmark()
+        {
+            int size = frames_.size();
+            double start = timestamp();
+            double next_time = start;
+            long waits = 0;
+            int sent = 0;
+            while(stream_active_) {
+                if(bench_.rate > 0) {
+                    double remains;
+                    while((remains = (next_time - timestamp())) > 0) {
+                        std::this_thread::sleep_for(std::chrono::microseconds(int(std::min(remains,0.5) * 1e6)));
+                        if(stream_active_ != 1)
+                            break;
+                    }
+                    next_time += 1.0 / bench_.rate;
+                }
+                else {
+                    // backpressure, don't overflow the pipeline so frames aren't dropped
+                    while(sync_queue_base::items > bench_.backlog && stream_active_ == 1) {
+                        std::this_thread::sleep_for(std::chrono::microseconds(200));
+                        waits++;
+                    }
+                }
+                if(stream_active_ != 1)
+                    break;
+                handle_frame(current_index_);
+                current_index_ = (current_index_ + 1) % size;
+                sent++;
+            }
+            double passed = timestamp() - start;
+            fprintf(stderr,"SIM benchmark: sent %d frames in %5.2fs, %5.2f fps, backpressure waits %ld\n",
+                sent,passed,(passed > 0 ? sent / passed : 0.0),waits);
+        }
+
         /// Start a video stream with provided callback 
         virtual void start_stream(CamStreamFormat format,frame_callback_type callback,CamErrorCode &e) 
         {
@@ -202,6 +326,10 @@ namespace ols {
                     callback_ = callback;
                 }
                 stream_active_ = 1;
+                if(bench_.enabled) {
+                    thread_ = std::move(std::thread([=]() { run_benchmark(); }));
+                    return;
+                }
                 thread_ = std::move(std::thread([=]() {
                     int size = frames_.size();
                     double next_time = timestamp() + exposure_ * 1e-3;
@@ -317,7 +445,16 @@ namespace ols {
             }
         }
     private:
+        struct FrameRef {
+            double timestamp;
+            std::string path;
+            int index;
+        };
+        static constexpr int prefetch_frames = 4;
+
         std::string dir_;
+        SIMBenchmark bench_;
+        std::vector<cv::Mat> preloaded_;
         int exposure_ = 1000;
         double gamma_ = 1.0;
         CamStreamType stream_ = stream_mjpeg;
@@ -333,7 +470,8 @@ namespace ols {
         std::mutex lock_;
         frame_callback_type callback_; 
         std::thread thread_;
-        std::vector<std::pair<double,std::string> > frames_;
+        std::vector<FrameRef> frames_;
+        std::unique_ptr<SERReader> ser_;
     };
  
 
@@ -344,16 +482,36 @@ namespace ols {
         {
             return std::vector<std::string>{"Simulation"};
         }
+        /// config is either directory path or JSON {"path":..., "benchmark":bool, "rate":fps, "backlog":items}
+        void parse_params(std::string &dir,SIMBenchmark &bench)
+        {
+            if(data_dir.empty() || data_dir[0] != '{') {
+                dir = data_dir;
+                return;
+            }
+            cppcms::json::value v;
+            std::istringstream ss(data_dir);
+            if(!v.load(ss,true))
+                throw SIMError("Parsing of inputs failed");
+            dir = v.get<std::string>("path","./sim");
+            bench.enabled = v.get("benchmark",bench.enabled);
+            bench.rate = v.get("rate",bench.rate);
+            bench.backlog = v.get("backlog",bench.backlog);
+            if(bench.rate < 0 || bench.backlog < 0)
+                throw SIMError("Invalid benchmark parameters");
+        }
         virtual std::unique_ptr<Camera> open_camera(int id,CamErrorCode &e) 
         {
             try {
                 if(id!=0)
                     throw SIMError("No such camera " + std::to_string(id));
-                std::string dir = data_dir;
+                std::string dir;
+                SIMBenchmark bench;
+                parse_params(dir,bench);
                 char *dir_override = getenv("OLS_SIM_DIR");
                 if(dir_override)
                     dir = dir_override;
-                std::unique_ptr<Camera> cam(new SIMCamera(dir));
+                std::unique_ptr<Camera> cam(new SIMCamera(dir,bench));
                 return cam;
             }
             catch(std::exception const &err) {
@@ -0,0 +1,502 @@
+#include "camera.h"
+#include <mutex>
+#include <sstream>
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <cmath>
+#include <string.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <thread>
+#include <chrono>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <cppcms/json.h>
+
+namespace ols {
+    class SynthError : public CamError {
+    public:
+        SynthError(std::string const &msg) : CamError(msg)
+        {
+        }
+    };
+
+    ///
+    /// Parameters of synthetic star field, all intensities are fractions of full range
+    ///
+    struct SynthConfig {
+        int width = 1920;
+        int height = 1080;
+        CamStreamType format = stream_raw16;
+        CamBayerType bayer = bayer_rg;
+        int stars = 2000;
+        double max_star = 0.9;      /// peak of brightest star, values above 1 saturate
+        double fwhm = 3.0;          /// seeing, pixels
+        double background = 0.05;
+        double noise = 0.01;        /// gaussian noise sigma
+        double drift_x = 0.5;       /// pixels per frame
+        double drift_y = 0.25;
+        double jitter = 0.0;        /// random gaussian shift per frame, pixels
+        double rotation = 0.0;      /// field rotation, degrees per frame around the center
+        double satellites = 0.0;    /// probability of a satellite trail in a frame
+        double clouds = 0.0;        /// probability of a frame being dimmed by clouds
+        double margin = 0.25;       /// star field extends beyond the frame by this fraction of its size
+        int seed = 1;
+        int exposure = 100;         /// ms, defines frame rate
+        std::string truth;          /// optional CSV file to write true per frame transformation to
+    };
+
+    class SynthCamera : public Camera {
+    public:
+        SynthCamera(SynthConfig const &cfg) :
+            cfg_(cfg),
+            rng_(cfg.seed)
+        {
+            stream_active_ = 0;
+            exposure_ = cfg_.exposure;
+            switch(cfg_.format) {
+            case stream_mono8:
+            case stream_mono16:
+                cfg_.bayer = bayer_na;
+                channels_ = 1;
+                break;
+            case stream_raw8:
+            case stream_raw16:
+                if(cfg_.bayer == bayer_na)
+                    throw SynthError("Bayer pattern is required for raw formats");
+                channels_ = 1;
+                break;
+            case stream_rgb24:
+            case stream_rgb48:
+                cfg_.bayer = bayer_na;
+                channels_ = 3;
+                break;
+            default:
+                throw SynthError("Unsupported format " + stream_type_to_str(cfg_.format));
+            }
+            bool is16 = cfg_.format == stream_mono16 || cfg_.format == stream_raw16 || cfg_.format == stream_rgb48;
+            out_type_ = CV_MAKETYPE(is16 ? CV_16U : CV_8U,channels_);
+            out_scale_ = is16 ? 65535 : 255;
+            if(cfg_.width < 16 || cfg_.height < 16 || cfg_.fwhm <= 0)
+                throw SynthError("Invalid synthetic camera geometry");
+            init_bayer_pattern();
+            generate_stars();
+        }
+
+        virtual ~SynthCamera()
+        {
+            try {
+                CamErrorCode e;
+                stop_stream(e);
+                e.check();
+            }
+            catch(std::exception const &e) {
+                fprintf(stderr,"Failed to close stream %s\n",e.what());
+            }
+            catch(...) {
+                fprintf(stderr,"Failed to close stream\n");
+            }
+        }
+        /// Camera name
+        virtual std::string name(CamErrorCode &)
+        {
+            return "Synthetic Star Field";
+        }
+        /// Return list of suppored video formats
+        virtual std::vector<CamStreamFormat> formats(CamErrorCode &)
+        {
+            CamStreamFormat fmt;
+            fmt.format = cfg_.format;
+            fmt.width = cfg_.width;
+            fmt.height = cfg_.height;
+            fmt.framerate = -1;
+            return std::vector<CamStreamFormat>{fmt};
+        }
+
+        double timestamp()
+        {
+            struct timeval tv;
+            gettimeofday(&tv,nullptr);
+            double unix_timestamp = tv.tv_sec;
+            unix_timestamp += tv.tv_usec * 1e-6;
+            return unix_timestamp;
+        }
+
+        /// Start a video stream with provided callback
+        virtual void start_stream(CamStreamFormat format,frame_callback_type callback,CamErrorCode &e)
+        {
+            try {
+                if(stream_active_ != 0) {
+                    stop_stream(e);
+                    e.check();
+                }
+                if(format.format != cfg_.format || format.width != cfg_.width || format.height != cfg_.height)
+                    throw SynthError("Invalid format");
+                if(!cfg_.truth.empty() && !truth_) {
+                    truth_ = fopen(cfg_.truth.c_str(),"w");
+                    if(!truth_)
+                        throw SynthError("Failed to open " + cfg_.truth);
+                    fprintf(truth_,"frame,timestamp,dx,dy,angle\n");
+                }
+                {
+                    std::unique_lock<std::mutex> guard(lock_);
+                    callback_ = callback;
+                }
+                stream_active_ = 1;
+                thread_ = std::move(std::thread([=]() { run(); }));
+            }
+            catch(std::exception const &err) {
+                e = CamErrorCode(err);
+            }
+        }
+
+        /// stop the stream - once function ends callback will not be called any more
+        virtual void stop_stream(CamErrorCode &e)
+        {
+            try {
+                if(stream_active_ == 0)
+                    return;
+                {
+                    std::unique_lock<std::mutex> guard(lock_);
+                    callback_ = nullptr;
+                }
+                stream_active_=0;
+                thread_.join();
+                if(truth_) {
+                    fclose(truth_);
+                    truth_ = nullptr;
+                }
+                if(rendered_ > 0) {
+                    fprintf(stderr,"SYNTH: rendered %d frames %dx%d, average render time %5.2f ms\n",
+                            rendered_,cfg_.width,cfg_.height,render_time_ * 1e3 / rendered_);
+                }
+            }
+            catch(std::exception const &err) {
+                e = CamErrorCode(err);
+            }
+        }
+
+        /// list of camera controls that the camera supports
+        virtual std::vector<CamOptionId> supported_options(CamErrorCode &)
+        {
+            std::vector<CamOptionId> opts = {opt_exp};
+            return opts;
+        }
+        /// get camera control
+        virtual CamParam get_parameter(CamOptionId id,bool /*current_only*/,CamErrorCode &e)
+        {
+            CamParam r;
+            memset(&r,0,sizeof(r));
+            r.option = id;
+            switch(id) {
+            case opt_exp:
+                r.type = type_msec;
+                r.min_val = 1;
+                r.max_val = 10000;
+                r.def_val = cfg_.exposure;
+                r.cur_val = exposure_;
+                r.step_size = 1;
+                break;
+            default:
+                e=CamErrorCode("Unimplemented: " + cam_option_id_to_name(id));
+            }
+            return r;
+        }
+        /// set camera control
+        virtual void set_parameter(CamOptionId id,double value,CamErrorCode &e)
+        {
+            try {
+                switch(id) {
+                case opt_exp:
+                    if(value < 1 || value > 10000)
+                        throw SynthError("Invalid range");
+                    exposure_ = value;
+                    break;
+                default:
+                    throw SynthError("Unimplemented" +  cam_option_id_to_name(id));
+                }
+            }
+            catch(std::exception const &err) {
+                e=CamErrorCode(err);
+            }
+        }
+    private:
+        struct Star {
+            float x,y;      /// position relative to the frame center at frame 0
+            float amp;
+            float color[3]; /// BGR
+        };
+
+        void init_bayer_pattern()
+        {
+            // channel index in BGR order for [row&1][col&1]
+            static const int patterns[4][2][2] = {
+                {{2,1},{1,0}}, // RGGB
+                {{1,2},{0,1}}, // GRBG
+                {{0,1},{1,2}}, // BGGR
+                {{1,0},{2,1}}, // GBRG
+            };
+            int id = 0;
+            switch(cfg_.bayer) {
+            case bayer_rg: id = 0; break;
+            case bayer_gr: id = 1; break;
+            case bayer_bg: id = 2; break;
+            case bayer_gb: id = 3; break;
+            default: id = 0;
+            }
+            memcpy(pattern_,patterns[id],sizeof(pattern_));
+        }
+
+        void generate_stars()
+        {
+            double span_x = cfg_.width * (1 + 2*cfg_.margin);
+            double span_y = cfg_.height * (1 + 2*cfg_.margin);
+            stars_.resize(cfg_.stars);
+            for(Star &s : stars_) {
+                s.x = rng_.uniform(-0.5,0.5) * span_x;
+                s.y = rng_.uniform(-0.5,0.5) * span_y;
+                // many faint stars, few bright ones
+                double u = rng_.uniform(0.0,1.0);
+                s.amp = cfg_.max_star * u * u * u * u;
+                double t = rng_.uniform(0.0,1.0);
+                s.color[0] = 0.7 + 0.6 * (1 - t);
+                s.color[1] = 1.0;
+                s.color[2] = 0.7 + 0.6 * t;
+            }
+            sigma_ = cfg_.fwhm / 2.3548;
+            radius_ = std::max(1,int(std::ceil(3 * sigma_)));
+            gx_.resize(2*radius_+2);
+            gy_.resize(2*radius_+2);
+        }
+
+        void draw_star(cv::Mat &img,float x,float y,float amp,float const *color)
+        {
+            int cx = int(std::floor(x));
+            int cy = int(std::floor(y));
+            int x0 = std::max(0,cx - radius_);
+            int x1 = std::min(img.cols - 1,cx + radius_ + 1);
+            int y0 = std::max(0,cy - radius_);
+            int y1 = std::min(img.rows - 1,cy + radius_ + 1);
+            if(x0 > x1 || y0 > y1)
+                return;
+            float k = float(-0.5 / (sigma_ * sigma_));
+            // separable gaussian
+            for(int c=x0;c<=x1;c++)
+                gx_[c-x0] = std::exp(k * (c - x)*(c - x));
+            for(int r=y0;r<=y1;r++)
+                gy_[r-y0] = amp * std::exp(k * (r - y)*(r - y));
+            for(int r=y0;r<=y1;r++) {
+                float *row = img.ptr<float>(r);
+                float gy = gy_[r-y0];
+                if(channels_ == 3) {
+                    for(int c=x0;c<=x1;c++) {
+                        float v = gy * gx_[c-x0];
+                        row[3*c+0] += v * color[0];
+                        row[3*c+1] += v * color[1];
+                        row[3*c+2] += v * color[2];
+                    }
+                }
+                else if(cfg_.bayer != bayer_na) {
+                    int const *pat = pattern_[r & 1];
+                    for(int c=x0;c<=x1;c++)
+                        row[c] += gy * gx_[c-x0] * color[pat[c & 1]];
+                }
+                else {
+                    for(int c=x0;c<=x1;c++)
+                        row[c] += gy * gx_[c-x0];
+                }
+            }
+        }
+
+        void render(int n,double &dx,double &dy,double &angle)
+        {
+            dx = cfg_.drift_x * n;
+            dy = cfg_.drift_y * n;
+            if(cfg_.jitter > 0) {
+                dx += rng_.gaussian(cfg_.jitter);
+                dy += rng_.gaussian(cfg_.jitter);
+            }
+            angle = cfg_.rotation * n;
+            double sn = std::sin(angle * M_PI / 180);
+            double cs = std::cos(angle * M_PI / 180);
+
+            double transparency = 1.0;
+            double background = cfg_.background;
+            if(cfg_.clouds > 0 && rng_.uniform(0.0,1.0) < cfg_.clouds) {
+                transparency = rng_.uniform(0.1,0.7);
+                background *= 2;
+            }
+
+            float_frame_.create(cfg_.height,cfg_.width,CV_MAKETYPE(CV_32F,channels_));
+            float_frame_.setTo(cv::Scalar::all(background));
+
+            double xc = cfg_.width / 2.0;
+            double yc = cfg_.height / 2.0;
+            for(Star const &s : stars_) {
+                float x = cs * s.x - sn * s.y + xc + dx;
+                float y = sn * s.x + cs * s.y + yc + dy;
+                if(x < -radius_ || y < -radius_ || x > cfg_.width + radius_ || y > cfg_.height + radius_)
+                    continue;
+                draw_star(float_frame_,x,y,s.amp * transparency,s.color);
+            }
+
+            if(cfg_.satellites > 0 && rng_.uniform(0.0,1.0) < cfg_.satellites) {
+                cv::Point p1(rng_.uniform(0,cfg_.width),0);
+                cv::Point p2(rng_.uniform(0,cfg_.width),cfg_.height - 1);
+                cv::line(float_frame_,p1,p2,cv::Scalar::all(rng_.uniform(0.2,1.0)),rng_.uniform(1,3));
+            }
+
+            if(cfg_.noise > 0) {
+                noise_.create(float_frame_.size(),float_frame_.type());
+                rng_.fill(noise_,cv::RNG::NORMAL,0,cfg_.noise);
+                float_frame_ += noise_;
+            }
+            float_frame_.convertTo(frame_,out_type_,out_scale_);
+        }
+
+        void handle_frame()
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            double dx,dy,angle;
+            render(frame_counter_,dx,dy,angle);
+            auto end = std::chrono::high_resolution_clock::now();
+            render_time_ += std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(end-start).count();
+            rendered_++;
+
+            CamFrame frm;
+            frm.unix_timestamp = timestamp();
+            frm.width = cfg_.width;
+            frm.height = cfg_.height;
+            frm.data = frame_.data;
+            frm.data_size = frame_.total() * frame_.elemSize();
+            frm.bayer = cfg_.bayer;
+            frm.format = cfg_.format;
+            frm.frame_counter = frame_counter_;
+            if(truth_)
+                fprintf(truth_,"%d,%.3f,%.4f,%.4f,%.5f\n",frame_counter_,frm.unix_timestamp,dx,dy,angle);
+            frame_counter_++;
+            {
+                std::unique_lock<std::mutex> guard(lock_);
+                if(callback_) {
+                    try {
+                        callback_(frm);
+                    }
+                    catch(std::exception const &e) {
+                        fprintf(stderr,"Exception in callback %s\n",e.what());
+                    }
+                    catch(...) {
+                        fprintf(stderr,"Unknown exception in callback\n");
+                    }
+                }
+            }
+        }
+
+        void run()
+        {
+            double next_time = timestamp() + exposure_ * 1e-3;
+            while(stream_active_) {
+                double remains;
+                while((remains = (next_time - timestamp()))>= 1e-3) {
+                    double ms = std::min(remains * 1000,500.0);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(int(ms)));
+                    if(stream_active_ != 1)
+                        return;
+                }
+                next_time += exposure_ * 1e-3;
+                handle_frame();
+            }
+        }
+
+        SynthConfig cfg_;
+        cv::RNG rng_;
+        std::vector<Star> stars_;
+        double sigma_;
+        int radius_;
+        std::vector<float> gx_,gy_;
+        int pattern_[2][2];
+        int channels_;
+        int out_type_;
+        double out_scale_;
+        cv::Mat float_frame_,noise_,frame_;
+        FILE *truth_ = nullptr;
+        int rendered_ = 0;
+        double render_time_ = 0;
+        std::atomic<int> exposure_;
+
+        std::atomic<int> stream_active_;
+        int frame_counter_ = 0;
+        // protected by mutex
+        std::mutex lock_;
+        frame_callback_type callback_;
+        std::thread thread_;
+    };
+
+
+
+    class SynthCameraDriver : public CameraDriver {
+    public:
+        virtual std::vector<std::string> list_cameras(CamErrorCode &)
+        {
+            return std::vector<std::string>{"Synthetic Star Field"};
+        }
+        void parse_params(SynthConfig &cfg)
+        {
+            if(config.empty())
+                return;
+            cppcms::json::value v;
+            std::istringstream ss(config);
+            if(!v.load(ss,true))
+                throw SynthError("Parsing of inputs failed");
+            cfg.width = v.get("width",cfg.width);
+            cfg.height = v.get("height",cfg.height);
+            cfg.format = stream_type_from_str(v.get("format",stream_type_to_str(cfg.format)));
+            cfg.bayer = bayer_type_from_str(v.get<std::string>("bayer","RGGB"));
+            cfg.stars = v.get("stars",cfg.stars);
+            cfg.max_star = v.get("max_star",cfg.max_star);
+            cfg.fwhm = v.get("fwhm",cfg.fwhm);
+            cfg.background = v.get("background",cfg.background);
+            cfg.noise = v.get("noise",cfg.noise);
+            cfg.drift_x = v.get("drift_x",cfg.drift_x);
+            cfg.drift_y = v.get("drift_y",cfg.drift_y);
+            cfg.jitter = v.get("jitter",cfg.jitter);
+            cfg.rotation = v.get("rotation",cfg.rotation);
+            cfg.satellites = v.get("satellites",cfg.satellites);
+            cfg.clouds = v.get("clouds",cfg.clouds);
+            cfg.margin = v.get("margin",cfg.margin);
+            cfg.seed = v.get("seed",cfg.seed);
+            cfg.exposure = v.get("exposure",cfg.exposure);
+            cfg.truth = v.get("truth",cfg.truth);
+        }
+        virtual std::unique_ptr<Camera> open_camera(int id,CamErrorCode &e)
+        {
+            try {
+                if(id!=0)
+                    throw SynthError("No such camera " + std::to_string(id));
+                SynthConfig cfg;
+                parse_params(cfg);
+                std::unique_ptr<Camera> cam(new SynthCamera(cfg));
+                return cam;
+            }
+            catch(std::exception const &err) {
+                e=CamErrorCode(err);
+                return std::unique_ptr<Camera>();
+            }
+        }
+        static std::string config;
+    };
+    std::string SynthCameraDriver::config;
+}
+
+extern "C" {
+    int ols_set_synth_driver_config(char const *str)
+    {
+        ols::SynthCameraDriver::config = str;
+        return 0;
+    }
+    ols::CameraDriver *ols_get_synth_driver(int )
+    {
+        return new ols::SynthCameraDriver();
+    }
+}
@@ -7,9 +7,13 @@
 #include <unistd.h>
 #include <system_error>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/inotify.h>
 #include <poll.h>
 #include <string.h>
+#include <algorithm>
+#include <deque>
+#include <set>
 
 
 namespace ols {
@@ -37,13 +41,28 @@ namespace ols {
     }
 
     struct DirWatch::data {
-        int data_size = 0;
-        union INotifyUnion {
-            char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
-            struct inotify_event event;
-        } ev;
+        // large enough to drain a burst of events in a single read
+        alignas(struct inotify_event) char buf[65536];
+        std::deque<std::string> pending;
     };
 
+    namespace {
+        /// true if some process holds the file open for writing, read lease can't be taken then
+        bool open_for_writing(std::string const &path)
+        {
+            int fd = open(path.c_str(),O_RDONLY | O_CLOEXEC);
+            if(fd < 0)
+                return false;
+            bool busy = false;
+            if(fcntl(fd,F_SETLEASE,F_RDLCK) == 0)
+                fcntl(fd,F_SETLEASE,F_UNLCK);
+            else
+                busy = errno == EAGAIN; // EACCES/EINVAL: not owner or no lease support, assume complete
+            close(fd);
+            return busy;
+        }
+    }
+
     DirWatch::DirWatch(std::string const &dir_name) : 
         dir_(dir_name),
         d(new DirWatch::data())
@@ -61,57 +80,104 @@ namespace ols {
     {
         close(fd_);
     }
-    bool DirWatch::has_enough()
+    std::vector<std::string> DirWatch::existing_files()
     {
-        return d->data_size >= int(sizeof(struct inotify_event)) 
-               && d->data_size >= (d->data_size >= int(d->ev.event.len + sizeof(struct inotify_event)));
+        std::unique_ptr<DIR,int(*)(DIR *)> dir(opendir(dir_.c_str()),closedir);
+        if(!dir)
+            throw std::system_error(errno,std::generic_category(),"Failed to open directory " + dir_);
+        std::vector<std::pair<struct timespec,std::string> > files;
+        std::set<std::string> scanned;
+        struct dirent *de;
+        while((de = readdir(dir.get())) != nullptr) {
+            std::string path = dir_ + "/" + de->d_name;
+            struct stat st;
+            if(stat(path.c_str(),&st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+            // still written, its close event delivers it
+            if(open_for_writing(path))
+                continue;
+            files.push_back(std::make_pair(st.st_mtim,path));
+            scanned.insert(de->d_name);
+        }
+        dir.reset();
+        // events queued before or during the scan for reported files are duplicates, later ones are new files
+        int got_bytes;
+        while((got_bytes = read(fd_,d->buf,sizeof(d->buf))) > 0)
+            parse_events(got_bytes,&scanned);
+        std::sort(files.begin(),files.end(),[](std::pair<struct timespec,std::string> const &a,std::pair<struct timespec,std::string> const &b) {
+            if(a.first.tv_sec != b.first.tv_sec)
+                return a.first.tv_sec < b.first.tv_sec;
+            if(a.first.tv_nsec != b.first.tv_nsec)
+                return a.first.tv_nsec < b.first.tv_nsec;
+            return a.second < b.second;
+        });
+        std::vector<std::string> res;
+        for(auto const &f : files)
+            res.push_back(f.second);
+        return res;
     }
-    std::string DirWatch::wait_for_new_file(int time_ms)
+    bool DirWatch::read_events(int time_ms)
     {
-        if(!has_enough()) {
-            struct pollfd pfd;
-            pfd.fd = fd_;
-            pfd.events = POLLIN;
-            int r = poll(&pfd,1,time_ms);
-            if(r < 0) {
-                int e = errno;
-                if(e == EINTR)
-                    return "";
-                throw std::system_error(errno,std::generic_category(),"watch failed failed on " + dir_ + " directory: poll");
-            }
-            if(r == 0) {
-                return "";
-            }
-            if(pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
-                throw std::runtime_error("Failed to read inotify on " + dir_);
-            }
-            if(!(r & POLLIN))
-                return "";
-            size_t reminder = sizeof(d->ev) - d->data_size;
-            char *buf = d->ev.buf + d->data_size;
-            int got_bytes = read(fd_,buf,reminder);
-            if(got_bytes < 0) {
-                int e = errno;
-                if(e == EAGAIN || e == EINTR)
-                    return "";
-                throw std::system_error(errno,std::generic_category(),"read watch failed failed on " + dir_ + " directory: poll");
-            }
-            if(got_bytes == 0) {
-                throw std::runtime_error("Unexpected EOF " + dir_);
-            }
-            d->data_size += got_bytes;
+        struct pollfd pfd;
+        pfd.fd = fd_;
+        pfd.events = POLLIN;
+        int r = poll(&pfd,1,time_ms);
+        if(r < 0) {
+            int e = errno;
+            if(e == EINTR)
+                return false;
+            throw std::system_error(e,std::generic_category(),"watch failed failed on " + dir_ + " directory: poll");
         }
-        if(!has_enough())
-            return "";
-        std::string name = dir_ + "/" + d->ev.event.name;
-        int consumed = d->ev.event.len + sizeof(struct inotify_event);
-        if(consumed == d->data_size) {
-            d->data_size = 0;
+        if(r == 0) {
+            return false;
+        }
+        if(pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            throw std::runtime_error("Failed to read inotify on " + dir_);
+        }
+        if(!(pfd.revents & POLLIN))
+            return false;
+        // inotify read always returns whole events
+        int got_bytes = read(fd_,d->buf,sizeof(d->buf));
+        if(got_bytes < 0) {
+            int e = errno;
+            if(e == EAGAIN || e == EINTR)
+                return false;
+            throw std::system_error(e,std::generic_category(),"read watch failed failed on " + dir_ + " directory");
         }
-        else {
-            memmove(d->ev.buf,d->ev.buf + consumed,d->data_size - consumed);
-            d->data_size = d->data_size = consumed;
+        if(got_bytes == 0) {
+            throw std::runtime_error("Unexpected EOF " + dir_);
         }
+        parse_events(got_bytes,nullptr);
+        return !d->pending.empty();
+    }
+    void DirWatch::parse_events(int got_bytes,std::set<std::string> const *skip)
+    {
+        int pos = 0;
+        while(pos + int(sizeof(struct inotify_event)) <= got_bytes) {
+            struct inotify_event const *ev = reinterpret_cast<struct inotify_event const *>(d->buf + pos);
+            pos += sizeof(struct inotify_event) + ev->len;
+            if(ev->len == 0 || (ev->mask & IN_ISDIR))
+                continue;
+            std::string name = ev->name;
+            if(skip && skip->count(name))
+                continue;
+            d->pending.push_back(dir_ + "/" + name);
+        }
+    }
+    std::vector<std::string> DirWatch::wait_for_new_files(int time_ms)
+    {
+        if(d->pending.empty())
+            read_events(time_ms);
+        std::vector<std::string> res(d->pending.begin(),d->pending.end());
+        d->pending.clear();
+        return res;
+    }
+    std::string DirWatch::wait_for_new_file(int time_ms)
+    {
+        if(d->pending.empty() && !read_events(time_ms))
+            return "";
+        std::string name = d->pending.front();
+        d->pending.pop_front();
         return name;
     }
 }
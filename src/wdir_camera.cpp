@@ -4,6 +4,8 @@
 #include <iostream>
 #include <atomic>
 #include <map>
+#include <deque>
+#include <condition_variable>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -36,12 +38,15 @@ namespace ols {
 
     class WDIRCamera : public Camera {
     public:
-        WDIRCamera(std::string const &dir,int width,int height,CamStreamType stream,CamBayerType bayer = bayer_na) 
+        WDIRCamera(std::string const &dir,int width,int height,CamStreamType stream,CamBayerType bayer = bayer_na,
+                   int decode_threads = 1,bool process_existing = false) 
             : dir_(dir),
               width_(width),
               height_(height),
               stream_(stream),
-              bayer_(bayer)
+              bayer_(bayer),
+              decode_threads_(std::max(1,decode_threads)),
+              process_existing_(process_existing)
         {
             stream_active_ = 0;
             switch(stream_) {
@@ -109,6 +114,19 @@ namespace ols {
                 return true;
             return false;
         }
+        /// file type that can be decoded to the configured format
+        bool supported_file(std::string const &name)
+        {
+            if(ends_with(name,".tiff") || ends_with(name,".tif") || ends_with(name,".png"))
+                return true;
+            if(bpp_ == 8 && (ends_with(name,".jpeg") || ends_with(name,".jpg")))
+                return true;
+#ifdef WITH_LIBRAW
+            if(raw_ && (ends_with(name,".dng") || ends_with(name,".raw")))
+                return true;
+#endif
+            return false;
+        }
 #ifdef WITH_LIBRAW
         std::string index2color(LibRaw &raw)
         {
@@ -157,49 +175,55 @@ namespace ols {
         }
 #endif
 
-        void handle_frame(std::string const &fname)
+        /// decode and validate the file, returns false if it should be skipped
+        bool decode_frame(std::string const &fname,cv::Mat &img,CamBayerType &bayer)
         {
-            CamFrame frm;
-            frm.unix_timestamp = timestamp();
-            frm.bayer = bayer_;
+            bayer = bayer_;
             struct stat st;
             if(stat(fname.c_str(),&st)!=0) {
                 BOOSTER_INFO("stacker") << "Failed to stat " << fname;
-                return;
+                return false;
             }
             if(!(st.st_mode & S_IFREG)) {
                 BOOSTER_INFO("stacker") << "Not regular file, skipping:" << fname;
-                return;
+                return false;
             }
 
-            cv::Mat img;
             if(ends_with(fname,".tiff") || ends_with(fname,".tif"))
                 img = load_tiff(fname);
 #ifdef WITH_LIBRAW
             else if(ends_with(fname,".dng") || ends_with(fname,".raw")) {
                 auto res = load_libraw(fname);
                 img = res.first; 
-                frm.bayer  = res.second;
+                bayer  = res.second;
             }
 #endif                
             else
                 img = cv::imread(fname);
             if(img.cols != width_ || img.rows != height_) {
                 BOOSTER_INFO("stacker") << "Image size is not correct";
-                return;
+                return false;
             }
             if(int(img.elemSize() / img.elemSize1()) != ((mono_ || raw_) ? 1 : 3)) {
                 BOOSTER_INFO("stack") << "file color space invalid, skpiing: " << fname;
-                return;
+                return false;
             }
             if(int(img.elemSize1()) != (bpp_ + 7) / 8) {
                 BOOSTER_INFO("stack") << "file depth invalid, skippng: " << fname;
-                return;
+                return false;
             }
-            if(raw_ && frm.bayer == bayer_na) {
+            if(raw_ && bayer == bayer_na) {
                 BOOSTER_INFO("stack") << "No bayer pattern info for raw image, skipping: " << fname;
-                return;
+                return false;
             }
+            return true;
+        }
+
+        void send_frame(cv::Mat const &img,CamBayerType bayer,double ts)
+        {
+            CamFrame frm;
+            frm.unix_timestamp = ts;
+            frm.bayer = bayer;
             frm.data = img.data;
             frm.data_size = img.rows * img.cols * img.elemSize();
             frm.height = height_;
@@ -223,6 +247,124 @@ namespace ols {
             }
         }
 
+        struct DecodeJob {
+            long seq;
+            std::string fname;
+            double ts;
+        };
+        struct DecodeResult {
+            bool ok = false;
+            cv::Mat img;
+            CamBayerType bayer = bayer_na;
+            double ts = 0;
+        };
+
+        /// queue file for decoding, blocks while too many files are in flight
+        void submit(std::string const &fname)
+        {
+            std::unique_lock<std::mutex> guard(pool_lock_);
+            while(stream_active_ && submitted_ - delivered_ >= max_in_flight())
+                pool_cond_.wait(guard);
+            if(!stream_active_)
+                return;
+            jobs_.push_back(DecodeJob{submitted_++,fname,timestamp()});
+            pool_cond_.notify_all();
+        }
+
+        int max_in_flight()
+        {
+            return 2 * decode_threads_;
+        }
+
+        void decode_worker()
+        {
+            while(true) {
+                DecodeJob job;
+                {
+                    std::unique_lock<std::mutex> guard(pool_lock_);
+                    while(stream_active_ && jobs_.empty())
+                        pool_cond_.wait(guard);
+                    if(!stream_active_)
+                        return;
+                    job = jobs_.front();
+                    jobs_.pop_front();
+                }
+                DecodeResult res;
+                res.ts = job.ts;
+                try {
+                    res.ok = decode_frame(job.fname,res.img,res.bayer);
+                }
+                catch(std::exception const &e) {
+                    BOOSTER_ERROR("stacker") << "Failed to read:" << job.fname << " ->" << e.what();
+                }
+                // keep what wasn't consumed, it may be the user's file
+                if(res.ok)
+                    std::remove(job.fname.c_str());
+                {
+                    std::unique_lock<std::mutex> guard(pool_lock_);
+                    results_[job.seq] = std::move(res);
+                }
+                deliver_ready();
+            }
+        }
+
+        /// send decoded frames in the order files were reported
+        void deliver_ready()
+        {
+            std::unique_lock<std::mutex> dguard(deliver_lock_);
+            while(true) {
+                DecodeResult res;
+                {
+                    std::unique_lock<std::mutex> guard(pool_lock_);
+                    auto p = results_.find(delivered_);
+                    if(p == results_.end())
+                        return;
+                    res = std::move(p->second);
+                    results_.erase(p);
+                }
+                if(res.ok)
+                    send_frame(res.img,res.bayer,res.ts);
+                {
+                    std::unique_lock<std::mutex> guard(pool_lock_);
+                    delivered_++;
+                    pool_cond_.notify_all();
+                }
+            }
+        }
+
+        void watch()
+        {
+            if(process_existing_) {
+                try {
+                    for(auto const &fname : wd_->existing_files()) {
+                        if(!supported_file(fname))
+                            continue;
+                        submit(fname);
+                        if(stream_active_ == 0)
+                            return;
+                    }
+                }
+                catch(std::exception const &e) {
+                    BOOSTER_ERROR("stacker") << "Failed to scan " << dir_ << ":" << e.what();
+                }
+            }
+            while(stream_active_ != 0) {
+                std::vector<std::string> files;
+                try {
+                    files = wd_->wait_for_new_files(500);
+                }
+                catch(std::exception const &e) {
+                    BOOSTER_ERROR("stacker") << "Failed to wait:" << e.what();
+                    return;
+                }
+                for(auto const &fname : files) {
+                    submit(fname);
+                    if(stream_active_ == 0)
+                        break;
+                }
+            }
+        }
+
         double timestamp()
         {
             struct timeval tv;
@@ -250,31 +392,14 @@ namespace ols {
                     std::unique_lock<std::mutex> guard(lock_);
                     callback_ = callback;
                 }
-                stream_active_ = 1;
                 wd_.reset(new DirWatch(dir_));
-                thread_ = std::move(std::thread([=]() {
-                    while(stream_active_ != 0) {
-                        std::string fname;
-                        try {
-                            fname = wd_->wait_for_new_file(500);
-                        }
-                        catch(std::exception const &e) {
-                            BOOSTER_ERROR("stacker") << "Failed to wait:" << e.what();
-                            return;
-                        }
-                        if(!fname.empty()) {
-                            try {
-                                handle_frame(fname);
-                            }
-                            catch(std::exception const &e) {
-                                BOOSTER_ERROR("stacker") << "Failed to read:" << fname << " ->" << e.what();
-                            }
-                            std::remove(fname.c_str());
-                        }
-                        if(stream_active_ == 0)
-                            break;
-                    }
-                }));
+                jobs_.clear();
+                results_.clear();
+                submitted_ = delivered_ = 0;
+                stream_active_ = 1;
+                for(int i=0;i<decode_threads_;i++)
+                    workers_.push_back(std::thread([=]() { decode_worker(); }));
+                thread_ = std::move(std::thread([=]() { watch(); }));
             }
             catch(std::exception const &err) {
                 e = CamErrorCode(err);
@@ -291,8 +416,15 @@ namespace ols {
                     std::unique_lock<std::mutex> guard(lock_);
                     callback_ = nullptr;
                 }
-                stream_active_=0;
+                {
+                    std::unique_lock<std::mutex> guard(pool_lock_);
+                    stream_active_=0;
+                    pool_cond_.notify_all();
+                }
                 thread_.join();
+                for(auto &t : workers_)
+                    t.join();
+                workers_.clear();
                 wd_.reset();
             }
             catch(std::exception const &err) {
@@ -327,10 +459,24 @@ namespace ols {
         CamStreamType stream_;
         CamBayerType bayer_;
 
+        int decode_threads_;
+        bool process_existing_;
+
         int bpp_;
         bool mono_;
         bool raw_;
 
+        // decode pool, protected by pool_lock_
+        std::mutex pool_lock_;
+        std::condition_variable pool_cond_;
+        std::deque<DecodeJob> jobs_;
+        std::map<long,DecodeResult> results_;
+        long submitted_ = 0;
+        long delivered_ = 0;
+        // serializes in order delivery
+        std::mutex deliver_lock_;
+        std::vector<std::thread> workers_;
+
         std::atomic<int> stream_active_;
         int frame_counter_ = 0;
         // protected by mutex
@@ -348,7 +494,7 @@ namespace ols {
         {
             return {"Directory Watcher"};
         }
-        void parse_params(std::string &dir,CamStreamType &stream,CamBayerType &bayer,int &width,int &height)
+        void parse_params(std::string &dir,CamStreamType &stream,CamBayerType &bayer,int &width,int &height,int &decode_threads,bool &process_existing)
         {
             cppcms::json::value v;
             std::istringstream ss(watch_info);
@@ -359,6 +505,8 @@ namespace ols {
             bayer = bayer_type_from_str(v.get<std::string>("bayer","NA"));
             width = v.get<int>("width");
             height = v.get<int>("height");
+            decode_threads = v.get("decode_threads",1);
+            process_existing = v.get("process_existing",false);
         }
         virtual std::unique_ptr<Camera> open_camera(int id,CamErrorCode &e) 
         {
@@ -370,8 +518,10 @@ namespace ols {
                 CamStreamType stream;
                 CamBayerType bayer;
 
-                parse_params(dir,stream,bayer,width,height);
-                std::unique_ptr<Camera> cam(new WDIRCamera(dir,width,height,stream,bayer));
+                int decode_threads;
+                bool process_existing;
+                parse_params(dir,stream,bayer,width,height,decode_threads,process_existing);
+                std::unique_ptr<Camera> cam(new WDIRCamera(dir,width,height,stream,bayer,decode_threads,process_existing));
                 return cam;
             }
             catch(std::exception const &err) {
@@ -1,29 +1,105 @@
 #include "data_items.h"
 #include "tiffmat.h"
+#include "ser_file.h"
 #include "processors.h"
 #include "util.h"
 #include <cppcms/json.h>
 #include <booster/log.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <condition_variable>
+#include <atomic>
+#include <iomanip>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
 
 namespace ols {
+    /// parameters of info.json replaced from the command line, value is parsed as JSON or taken as string
+    typedef std::vector<std::pair<std::string,std::string> > overrides_type;
+
+    struct SessionResult {
+        std::string dir;
+        std::string name;
+        bool ok = false;
+        std::string error;
+        int frames = 0;
+        size_t bytes = 0;
+        double seconds = 0;
+        std::vector<std::string> outputs;
+    };
+
+    struct SimulatorOptions {
+        overrides_type overrides;
+        int preload = 10;               /// frames decoded ahead of the preprocessor
+        bool run_pp = false;            /// generate output frames as live stacking does
+        bool two_pass = false;          /// score all frames first and register against the best one
+        float reject_percent = 0;       /// two pass: skip this percentile of the worst frames
+        std::string output_name;        /// name of the stacked files, session name if empty
+    };
+
     class Simulator {
     public:
-        Simulator(std::string const &dir,std::string output_dir) :
+        /// line of log.txt: a frame or a pause
+        struct LogEntry {
+            bool pause = false;
+            int frame_id = -1;
+            double timestamp = 0;
+        };
+
+        Simulator(std::string const &dir,std::string output_dir,SimulatorOptions const &opts = SimulatorOptions()) :
             dir_(dir),
-            output_dir_(output_dir)
+            output_dir_(output_dir),
+            opts_(opts),
+            preload_(std::max(1,opts.preload)),
+            // frames are decoded by the loader ahead of the preprocessor up to the queue limit
+            input_queue_(new queue_type(preload_))
         {
             load_config();
         }
 
-        void run(bool run_pp)
+        std::string const &name()
+        {
+            return cfg_.name;
+        }
+
+        /// calibration sessions update the shared index.json of the output directory
+        bool calibration()
+        {
+            return cfg_.calibration;
+        }
+
+        ///
+        /// Rough peak memory of the session: decoded frames waiting in the queues, processed
+        /// float frames and the stacker accumulators
+        ///
+        size_t estimate_memory()
+        {
+            size_t channels = cfg_.mono ? 1 : 3;
+            size_t frame = size_t(cfg_.width) * cfg_.height * channels * sizeof(float);
+            size_t scale = std::max(1,cfg_.drizzle_scale);
+            size_t queued = size_t(preload_ + 10 + 2) * frame;
+            size_t stacker = frame * (6 + 2 * scale * scale + (cfg_.lucky_compact ? 1 : 2) * cfg_.lucky_window / 2);
+            for(auto const &o : cfg_.outputs) {
+                size_t oscale = std::max(1,o.drizzle_scale);
+                stacker += frame * (4 + 2 * oscale * oscale) / (o.channel >= 0 ? channels : 1);
+            }
+            return queued + stacker;
+        }
+
+        SessionResult run()
         {
+            SessionResult res;
+            res.dir = dir_;
+            res.name = cfg_.name;
+            auto start = std::chrono::steady_clock::now();
+
             queue_pointer_type out;
-            if(run_pp) {
+            if(opts_.run_pp) {
                 out = std::shared_ptr<queue_type>(new queue_type());
                 out->call_on_push([](std::shared_ptr<QueueData> ){});
             }
@@ -33,18 +109,44 @@ namespace ols {
             std::cerr << cfg_.width << " " << cfg_.height << std::endl;
             input_queue_->push(ctl);
             try {
-                load_frames();
+                open_source();
+                std::vector<bool> skip(log_.size(),false);
+                if(opts_.two_pass && !cfg_.calibration)
+                    select_frames(skip);
+                load_frames(skip);
                 ctl.reset(new StackerControl());
                 ctl->op = StackerControl::ctl_save;
                 input_queue_->push(ctl);
+                res.ok = true;
             }
             catch(std::exception &e) {
                 std::cerr << "Failed " << e.what() << std::endl;
+                res.error = e.what();
             }
             std::shared_ptr<ShutDownData> end(new ShutDownData());
             input_queue_->push(end);
             t1.join();
             t2.join();
+            auto finish = std::chrono::steady_clock::now();
+            res.seconds = std::chrono::duration_cast<std::chrono::duration<double> >(finish - start).count();
+            res.frames = frames_;
+            res.bytes = bytes_;
+            std::vector<std::string> candidates;
+            if(cfg_.calibration)
+                candidates.push_back(cfg_.output_path + "/" + cfg_.name + ".tiff");
+            else {
+                candidates = { cfg_.output_path + "_stacked_v1.tiff", cfg_.output_path + "_stacked_v1.jpeg" };
+                for(auto const &o : cfg_.outputs) {
+                    std::string base = cfg_.output_path + "_" + o.suffix + "_stacked_v1";
+                    candidates.push_back(base + ".tiff");
+                    candidates.push_back(base + ".jpeg");
+                }
+            }
+            for(auto const &path : candidates) {
+                if(exists(path))
+                    res.outputs.push_back(path);
+            }
+            return res;
         }
 
         std::string file_name(int frame_id,std::string const &ext)
@@ -54,63 +156,185 @@ namespace ols {
             return dir_ + name;
         }
 
-        void load_frames()
+        /// read log.txt and detect format of the frames
+        void open_source()
         {
             std::ifstream data(dir_  + "/log.txt");
             if(!data)
                 throw std::runtime_error("Failed to read log file");
-            std::string ext;
+            std::string ser_path = dir_ + "/frames.ser";
+            if(exists(ser_path)) {
+                ser_.reset(new SERReader(ser_path));
+                ext_ = "ser";
+                bayer_ = ser_->bayer();
+            }
             std::string str;
             while(std::getline(data,str)) {
                 size_t pos = str.find(',');
                 std::string op = str.substr(0,pos);
+                LogEntry e;
                 if(op == "PAUSE") {
-                    std::shared_ptr<StackerControl> ctl(new StackerControl());
-                    ctl->op = StackerControl::ctl_pause;
-                    input_queue_->push(ctl);
+                    e.pause = true;
                 }
                 else {
-                    int frame_id = atoi(op.c_str());
-                    double timestamp = atof(str.substr(pos+1).c_str());
-                    if(ext.empty()) {
-                        if(exists(file_name(frame_id,"jpeg")))
-                            ext="jpeg";
+                    e.frame_id = atoi(op.c_str());
+                    e.timestamp = atof(str.substr(pos+1).c_str());
+                    if(ext_.empty()) {
+                        if(exists(file_name(e.frame_id,"jpeg")))
+                            ext_="jpeg";
                         else
-                            ext="tiff";
+                            ext_="tiff";
+                    }
+                    if(ser_ && e.frame_id >= ser_->frames())
+                        break; // capture wasn't closed properly
+                }
+                log_.push_back(e);
+            }
+        }
+
+        /// load and debayer a frame, safe to call concurrently
+        cv::Mat load_frame(int frame_id,int &dr,std::string &path)
+        {
+            cv::Mat img;
+            if(ext_ == "ser" || ext_ == "tiff") {
+                if(ext_ == "ser") {
+                    // mapped memory, valid as long as ser_ exists
+                    img = ser_->frame(frame_id);
+                    path = dir_ + "/frames.ser:" + std::to_string(frame_id);
+                }
+                else {
+                    path = file_name(frame_id,ext_);
+                    img = load_tiff(path);
+                }
+                dr = (1ll << (8*img.elemSize1())) - 1;
+                if(bayer_ != bayer_na) {
+                    cv::Mat rgb;
+                    switch(bayer_) {
+                    case bayer_rg:  cv::cvtColor(img,rgb,cv::COLOR_BayerBG2BGR); break; // COLOR_BayerRGGB2BGR = COLOR_BayerBG2BGR
+                    case bayer_gr:  cv::cvtColor(img,rgb,cv::COLOR_BayerGB2BGR); break; // COLOR_BayerGRBG2BGR = COLOR_BayerGB2BGR
+                    case bayer_bg:  cv::cvtColor(img,rgb,cv::COLOR_BayerRG2BGR); break; // COLOR_BayerBGGR2BGR = COLOR_BayerRG2BGR
+                    case bayer_gb:  cv::cvtColor(img,rgb,cv::COLOR_BayerGR2BGR); break; // COLOR_BayerGBRG2BGR = COLOR_BayerGR2BGR
+                    default:
+                        BOOSTER_ERROR("stacker") << "Invalid bayer patter";
                     }
-                    std::string path = file_name(frame_id,ext);
-                    cv::Mat img;
+                    img = rgb;
+                }
+            }
+            else {
+                path = file_name(frame_id,ext_);
+                img = cv::imread(path);
+                dr = 255;
+            }
+            return img;
+        }
+
+        ///
+        /// Quality of the frame for reference selection: variance of laplacian of downscaled
+        /// luminance normalized by brightness, same measure lucky imaging uses for its window
+        ///
+        static float frame_score(cv::Mat img)
+        {
+            cv::Mat gray,small,lap;
+            if(img.channels() == 3)
+                cv::cvtColor(img,gray,cv::COLOR_BGR2GRAY);
+            else
+                gray = img;
+            double factor = std::min(1.0,1024.0 / std::max(gray.cols,gray.rows));
+            if(factor < 1.0)
+                cv::resize(gray,small,cv::Size(),factor,factor,cv::INTER_AREA);
+            else
+                small = gray;
+            small.convertTo(small,CV_32FC1);
+            cv::Laplacian(small,lap,CV_32F);
+            cv::Scalar mean,lap_mean,lap_std;
+            mean = cv::mean(small);
+            cv::meanStdDev(lap,lap_mean,lap_std);
+            double m = std::max(1e-6,mean[0]);
+            return lap_std[0] * lap_std[0] / (m * m);
+        }
+
+        ///
+        /// First pass: score all frames in parallel, pick the best one as registration reference
+        /// and mark the worst frames to skip
+        ///
+        void select_frames(std::vector<bool> &skip)
+        {
+            auto start = std::chrono::steady_clock::now();
+            std::vector<int> frames;
+            for(size_t i=0;i<log_.size();i++) {
+                if(!log_[i].pause)
+                    frames.push_back(i);
+            }
+            if(frames.empty())
+                return;
+            std::vector<float> scores(frames.size());
+            cv::parallel_for_(cv::Range(0,frames.size()),[&](cv::Range const &range) {
+                for(int i=range.start;i<range.end;i++) {
                     int dr;
-                    if(ext == "tiff") {
-                        img = load_tiff(path);
-                        dr = (1ll << (8*img.elemSize1())) - 1;
-                        if(bayer_ != bayer_na) {
-                            cv::Mat rgb;
-                            switch(bayer_) {
-                            case bayer_rg:  cv::cvtColor(img,rgb,cv::COLOR_BayerBG2BGR); break; // COLOR_BayerRGGB2BGR = COLOR_BayerBG2BGR
-                            case bayer_gr:  cv::cvtColor(img,rgb,cv::COLOR_BayerGB2BGR); break; // COLOR_BayerGRBG2BGR = COLOR_BayerGB2BGR
-                            case bayer_bg:  cv::cvtColor(img,rgb,cv::COLOR_BayerRG2BGR); break; // COLOR_BayerBGGR2BGR = COLOR_BayerRG2BGR
-                            case bayer_gb:  cv::cvtColor(img,rgb,cv::COLOR_BayerGR2BGR); break; // COLOR_BayerGBRG2BGR = COLOR_BayerGR2BGR
-                            default:
-                                BOOSTER_ERROR("stacker") << "Invalid bayer patter";
-                            }
-                            img = rgb;
+                    std::string path;
+                    cv::Mat img = load_frame(log_[frames[i]].frame_id,dr,path);
+                    scores[i] = img.empty() ? 0 : frame_score(img);
+                }
+            });
+            int best = std::max_element(scores.begin(),scores.end()) - scores.begin();
+            reference_ = frames[best];
+            int rejected = 0;
+            if(opts_.reject_percent > 0) {
+                std::vector<float> sorted = scores;
+                int n = std::min(int(sorted.size()) - 1,int(sorted.size() * opts_.reject_percent / 100.0f));
+                if(n > 0) {
+                    std::nth_element(sorted.begin(),sorted.begin() + n,sorted.end());
+                    float limit = sorted[n];
+                    for(size_t i=0;i<frames.size();i++) {
+                        if(scores[i] < limit) {
+                            skip[frames[i]] = true;
+                            rejected++;
                         }
                     }
-                    else {
-                        img = cv::imread(path);
-                        dr = 255;
-                    }
-                    std::shared_ptr<CameraFrame> frame(new CameraFrame);
-                    frame->frame = img;
-                    frame->frame_dr = dr;
-                    frame->timestamp = timestamp;
-                    BOOSTER_INFO("stacker") << "Loaded image " << (path) << " " << img.rows<<"x"<<img.cols << std::endl;
-                    input_queue_->push(frame);
                 }
             }
-            
+            auto finish = std::chrono::steady_clock::now();
+            double passed = std::chrono::duration_cast<std::chrono::duration<double> >(finish - start).count();
+            BOOSTER_WARNING("stacker") << "Scored " << frames.size() << " frames in " << passed << " s, reference frame "
+                << log_[reference_].frame_id << " score " << scores[best] << ", rejected " << rejected;
+        }
+
+        std::shared_ptr<CameraFrame> make_frame(LogEntry const &e)
+        {
+            int dr;
+            std::string path;
+            cv::Mat img = load_frame(e.frame_id,dr,path);
+            if(ser_)
+                ser_->prefetch(e.frame_id + 1,preload_);
+            std::shared_ptr<CameraFrame> frame(new CameraFrame);
+            frame->frame = img;
+            frame->frame_dr = dr;
+            frame->timestamp = e.timestamp;
+            BOOSTER_INFO("stacker") << "Loaded image " << (path) << " " << img.rows<<"x"<<img.cols << std::endl;
+            return frame;
+        }
 
+        void load_frames(std::vector<bool> const &skip)
+        {
+            if(reference_ >= 0) {
+                auto frame = make_frame(log_[reference_]);
+                frame->reference = true;
+                input_queue_->push(frame);
+            }
+            for(size_t i=0;i<log_.size();i++) {
+                if(log_[i].pause) {
+                    std::shared_ptr<StackerControl> ctl(new StackerControl());
+                    ctl->op = StackerControl::ctl_pause;
+                    input_queue_->push(ctl);
+                    continue;
+                }
+                if(skip[i])
+                    continue;
+                auto frame = make_frame(log_[i]);
+                frames_++;
+                bytes_ += frame->frame.total() * frame->frame.elemSize();
+                input_queue_->push(frame);
+            }
         }
 
         void load_config()
@@ -118,7 +342,15 @@ namespace ols {
             std::ifstream cfg_file(dir_ + "/info.json");
             cppcms::json::value v;
             if(!v.load(cfg_file,true))
-                throw std::runtime_error("Failed to load config");
+                throw std::runtime_error("Failed to load config from " + dir_);
+            for(auto const &o : opts_.overrides) {
+                cppcms::json::value val;
+                std::istringstream ss(o.second);
+                if(val.load(ss,true))
+                    v[o.first] = val;
+                else
+                    v[o.first] = o.second;
+            }
 
             StackerControl cfg;
             cfg.name = v.get<std::string>("name");
@@ -141,38 +373,250 @@ namespace ols {
             cfg.stretch_high = v.get<double>("stretch_high");
             cfg.stretch_gamma = v.get<double>("stretch_gamma");
             cfg.remove_satellites = v.get("remove_satellites",cfg.remove_satellites);
+            cfg.drizzle_scale = v.get("drizzle_scale",cfg.drizzle_scale);
+            cfg.drizzle_pixfrac = v.get("drizzle_pixfrac",cfg.drizzle_pixfrac);
+            cfg.lucky_window = v.get("lucky_window",cfg.lucky_window);
+            cfg.lucky_keep_percent = v.get("lucky_keep_percent",cfg.lucky_keep_percent);
+            cfg.lucky_compact = v.get("lucky_compact",cfg.lucky_compact);
+            cfg.canvas = v.get("canvas",cfg.canvas);
+            cfg.frame_weighting = v.get("frame_weighting",cfg.frame_weighting);
+            cfg.background_extraction = v.get("background_extraction",cfg.background_extraction);
+            cfg.wb_stars = v.get("wb_stars",cfg.wb_stars);
+            cfg.estimate_rotation = v.get("estimate_rotation",cfg.estimate_rotation);
+            cppcms::json::value const &outputs = v.find("outputs");
+            if(outputs.type() == cppcms::json::is_array) {
+                for(auto const &o : outputs.array()) {
+                    StackerOutputConfig out;
+                    out.suffix = o.get<std::string>("suffix");
+                    out.channel = o.get("channel",out.channel);
+                    out.remove_satellites = o.get("remove_satellites",out.remove_satellites);
+                    out.frame_weighting = o.get("frame_weighting",out.frame_weighting);
+                    out.drizzle_scale = o.get("drizzle.scale",out.drizzle_scale);
+                    out.drizzle_pixfrac = o.get("drizzle.pixfrac",out.drizzle_pixfrac);
+                    cfg.outputs.push_back(out);
+                }
+            }
             bayer_ = bayer_type_from_str(v.get<std::string>("bayer","NA"));
 
             if(!cfg.calibration)
-                cfg.output_path =  output_dir_ + "/" + cfg.name;
+                cfg.output_path =  output_dir_ + "/" + (opts_.output_name.empty() ? cfg.name : opts_.output_name);
             else
                 cfg.output_path =  output_dir_;
             cfg_ = cfg;
         }
 
         std::string dir_,output_dir_;
+        SimulatorOptions opts_;
+        int preload_;
+        std::vector<LogEntry> log_;
+        std::string ext_;
+        int reference_ = -1;    /// index in log_ of the reference frame selected by first pass
        
         // limit queue size for offline processing 
-        queue_pointer_type input_queue_      = std::shared_ptr<queue_type>(new queue_type(10));
+        queue_pointer_type input_queue_;
         queue_pointer_type stacker_queue_    = std::shared_ptr<queue_type>(new queue_type(10));
         StackerControl cfg_;
         CamBayerType bayer_;
+        int frames_ = 0;
+        size_t bytes_ = 0;
+        // frames pushed to the queues reference its memory, keep it until the threads are done
+        std::unique_ptr<SERReader> ser_;
+    };
+
+    ///
+    /// Memory shared by concurrently processed sessions, a session that does not fit waits
+    /// until others finish; a session larger than the whole budget runs alone
+    ///
+    class MemoryBudget {
+    public:
+        MemoryBudget(size_t limit) : limit_(limit)
+        {
+        }
+        void acquire(size_t size)
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            while(used_ > 0 && used_ + size > limit_)
+                cond_.wait(guard);
+            used_ += size;
+        }
+        void release(size_t size)
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            used_ -= size;
+            cond_.notify_all();
+        }
+    private:
+        std::mutex lock_;
+        std::condition_variable cond_;
+        size_t limit_;
+        size_t used_ = 0;
+    };
+
+    ///
+    /// Processes many debug directories on a pool of \a jobs threads, each session runs its own
+    /// loader, preprocessor and stacker threads
+    ///
+    class BatchRunner {
+    public:
+        BatchRunner(std::vector<std::string> const &dirs,std::string const &output_dir,SimulatorOptions const &opts,
+                    int jobs,size_t memory_limit) :
+            dirs_(dirs),
+            output_dir_(output_dir),
+            opts_(opts),
+            jobs_(std::max(1,std::min(jobs,int(dirs.size())))),
+            budget_(memory_limit),
+            results_(dirs.size())
+        {
+            // sessions often share a name, stacked files are named after the debug directory instead
+            std::set<std::string> used;
+            for(auto const &dir : dirs_) {
+                std::string base = dir;
+                while(base.size() > 1 && base.back() == '/')
+                    base.pop_back();
+                size_t pos = base.rfind('/');
+                if(pos != std::string::npos)
+                    base = base.substr(pos + 1);
+                std::string name = base;
+                for(int n = 1;used.count(name);n++)
+                    name = base + "_" + std::to_string(n);
+                used.insert(name);
+                output_names_.push_back(name);
+            }
+        }
+
+        /// returns number of failed sessions
+        int run()
+        {
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> workers;
+            for(int i=0;i<jobs_;i++)
+                workers.push_back(std::thread([this]() { worker(); }));
+            for(auto &t : workers)
+                t.join();
+            auto finish = std::chrono::steady_clock::now();
+            double passed = std::chrono::duration_cast<std::chrono::duration<double> >(finish - start).count();
+            return summary(passed);
+        }
+
+    private:
+        void worker()
+        {
+            size_t index;
+            while((index = next_++) < dirs_.size()) {
+                SessionResult &res = results_[index];
+                res.dir = dirs_[index];
+                try {
+                    SimulatorOptions opts = opts_;
+                    opts.output_name = output_names_[index];
+                    Simulator sim(dirs_[index],output_dir_,opts);
+                    // calibration sessions run one at a time
+                    std::unique_lock<std::mutex> calibration_guard(calibration_lock_,std::defer_lock);
+                    if(sim.calibration())
+                        calibration_guard.lock();
+                    size_t memory = sim.estimate_memory();
+                    budget_.acquire(memory);
+                    try {
+                        res = sim.run();
+                    }
+                    catch(...) {
+                        budget_.release(memory);
+                        throw;
+                    }
+                    budget_.release(memory);
+                }
+                catch(std::exception const &e) {
+                    res.ok = false;
+                    res.error = e.what();
+                }
+            }
+        }
+
+        int summary(double passed)
+        {
+            int failed = 0;
+            int frames = 0;
+            size_t bytes = 0;
+            std::cout << "Batch summary:" << std::endl;
+            for(auto const &r : results_) {
+                frames += r.frames;
+                bytes += r.bytes;
+                std::cout << " - " << r.dir << ": ";
+                if(!r.ok) {
+                    failed++;
+                    std::cout << "FAILED " << r.error << std::endl;
+                    continue;
+                }
+                double fps = r.seconds > 0 ? r.frames / r.seconds : 0;
+                std::cout << r.frames << " frames in " << std::fixed << std::setprecision(1) << r.seconds << " s, "
+                          << fps << " fps" << std::defaultfloat << std::endl;
+                for(auto const &path : r.outputs)
+                    std::cout << "     " << path << std::endl;
+            }
+            std::cout << "Total: " << results_.size() << " sessions (" << failed << " failed), " << frames << " frames in "
+                      << std::fixed << std::setprecision(1) << passed << " s, "
+                      << (passed > 0 ? frames / passed : 0) << " fps, "
+                      << (passed > 0 ? bytes / passed / (1024*1024) : 0) << " MB/s" << std::defaultfloat << std::endl;
+            return failed;
+        }
+
+        std::vector<std::string> dirs_;
+        std::vector<std::string> output_names_;
+        std::string output_dir_;
+        SimulatorOptions opts_;
+        int jobs_;
+        std::mutex calibration_lock_;
+        MemoryBudget budget_;
+        std::atomic<size_t> next_{0};
+        std::vector<SessionResult> results_;
     };
 }
 
 int main(int argc,char **argv)
 {
-    bool run_pp = false;
+    bool batch = false;
     int threads = -1;
+    int jobs = std::max(1u,std::thread::hardware_concurrency() / 2);
+    size_t memory_mb = 4096;
+    ols::SimulatorOptions opts;
     while(argc >= 2 && argv[1][0]=='-' && argv[1][1] != 0) {
         char code = argv[1][1];
         switch(code) {
         case 'p':
-            run_pp = true;
+            opts.run_pp = true;
+            break;
+        case '2':
+            opts.two_pass = true;
+            break;
+        case 'r':
+            opts.two_pass = true;
+            opts.reject_percent = std::max(0.0,std::min(99.0,atof(argv[1]+2)));
             break;
         case 't':
             threads = atoi(argv[1]+2);
             break;
+        case 'b':
+            batch = true;
+            break;
+        case 'j':
+            jobs = std::max(1,atoi(argv[1]+2));
+            break;
+        case 'm':
+            memory_mb = std::max(1,atoi(argv[1]+2));
+            break;
+        case 'q':
+            opts.preload = std::max(1,atoi(argv[1]+2));
+            break;
+        case 'o':
+            {
+                std::string opt = argv[1]+2;
+                size_t pos = opt.find('=');
+                if(pos == std::string::npos || pos == 0) {
+                    fprintf(stderr,"Invalid override %s, expected key=value\n",opt.c_str());
+                    return 1;
+                }
+                opts.overrides.push_back(std::make_pair(opt.substr(0,pos),opt.substr(pos+1)));
+            }
+            break;
         default:
             fprintf(stderr,"Invalid parameter %c",code);
             return 1;
@@ -180,17 +624,32 @@ int main(int argc,char **argv)
         argc--;
         argv++;
     }
-    if(argc !=3) {
-        std::cerr << "Usage [-p] [-tN] debug_dir output_dir " << std::endl;
+    if((!batch && argc !=3) || (batch && argc < 3)) {
+        std::cerr << "Usage [-p] [-tN] [-qN] [-2] [-rP] [-okey=value]... debug_dir output_dir " << std::endl;
+        std::cerr << "      -b [-p] [-tN] [-qN] [-2] [-rP] [-jN] [-mMB] [-okey=value]... output_dir debug_dir... " << std::endl;
+        std::cerr << "  -b batch mode, process many debug directories, stacked files are named after the debug directory" << std::endl;
+        std::cerr << "  -j number of sessions processed concurrently" << std::endl;
+        std::cerr << "  -m memory budget in MB shared by concurrent sessions, default 4096" << std::endl;
+        std::cerr << "  -q number of frames loaded ahead of processing, default 10" << std::endl;
+        std::cerr << "  -2 two pass: score all frames and use the sharpest one as registration reference" << std::endl;
+        std::cerr << "  -r two pass rejecting P percent of the worst frames" << std::endl;
+        std::cerr << "  -o override info.json parameter, for example -oremove_satellites=true -ostretch_gamma=2.2" << std::endl;
+        std::cerr << "     -odarks=/path/to/darks.tiff, value is parsed as JSON or used as string" << std::endl;
         return 1;
     }
     try {
         if(threads != -1)
             cv::setNumThreads(threads);
-        booster::log::logger::instance().set_default_level(booster::log::debug);
+        booster::log::logger::instance().set_default_level(batch ? booster::log::warning : booster::log::debug);
         booster::log::logger::instance().add_sink(std::make_shared<booster::log::sinks::standard_error>());
-        ols::Simulator sim(argv[1],argv[2]);
-        sim.run(run_pp);
+        if(batch) {
+            std::vector<std::string> dirs(argv + 2,argv + argc);
+            ols::BatchRunner runner(dirs,argv[1],opts,jobs,memory_mb * 1024 * 1024);
+            return runner.run() == 0 ? 0 : 1;
+        }
+        ols::Simulator sim(argv[1],argv[2],opts);
+        if(!sim.run().ok)
+            return 1;
     }
     catch(std::exception const &e) {
         std::cerr << e.what() << std::endl;
@@ -67,12 +67,9 @@ int main(int argc,char **argv)
         path = cfg.get("libdir","");
         astap_exe = cfg.get("astap.exe","astap_cli");
         astap_db = cfg.get("astap.db","");
-        if(driver == "sim") {
-            driver_opt = cfg.get("sim.path","");
-        }
-        else if(driver == "wdir") {
+        if((driver == "sim" || driver == "wdir" || driver == "synth") && cfg.find(driver).type() == cppcms::json::is_object) {
             std::ostringstream ss;
-            ss<<cfg["wdir"];
+            ss<<cfg[driver];
             driver_opt = ss.str();
         }
 
@@ -668,7 +668,10 @@ function updateHistogram()
 function updateStackerStats(e) {
     var stats = JSON.parse(e);
     if(stats.type == 'stats') { 
-        document.getElementById('stats_info').innerHTML = stats.stacked + '/' + stats.missed + '/' + stats.dropped;
+        var dropped = stats.dropped;
+        if(stats.sdk_dropped > 0)
+            dropped = dropped + '+' + stats.sdk_dropped;
+        document.getElementById('stats_info').innerHTML = stats.stacked + '/' + stats.missed + '/' + dropped;
         g_since_saved_s = stats.since_saved_s;
         if(stats.histogramm.length == 0)
             g_histogram = null;
@@ -1328,6 +1331,7 @@ function startStack()
     var config={
         name:               name,
         save_data:          getBVal("save_data"),
+        save_format:        getBVal("save_ser") ? "ser" : "files",
         field_derotation:   field_derotation,
         image_flip:         getBVal("image_flip"),
         remove_satellites:  getBVal("remove_satellites"),
@@ -1464,7 +1468,8 @@ function plateSolveWithOpt(background)
             "rad" : rad,
             "lat" : lat,
             "lon" : lon,
-            "timeout" : timeout
+            "timeout" : timeout,
+            "refine" : background // auto restart: start from previous solution
         };
         JSON.stringify(req); // check it is OK
     }